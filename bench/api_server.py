@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+# A stand-in for the Funkwhale API behind bench/nghttpx.conf: listings take
+# ``think`` seconds to render, uploads are read to the end.
+#
+#     bench/api_server.py [port] [think]
+
+import http.server
+import json
+import socketserver
+import sys
+import time
+
+port = int(sys.argv[1]) if len(sys.argv) > 1 else 8780
+think = float(sys.argv[2]) if len(sys.argv) > 2 else 0.02
+
+page = json.dumps({
+    "count": 1000,
+    "next": None,
+    "results": [{"id": i, "title": "Track %d" % i, "listen_url": "/api/v1/listen/%d/" % i}
+                for i in range(50)],
+}).encode()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def reply(self, body):
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_GET(self):
+        time.sleep(think)
+        self.reply(page)
+
+    def do_POST(self):
+        left = int(self.headers.get("Content-Length") or 0)
+        size = left
+
+        while left > 0:
+            chunk = self.rfile.read(min(left, 256*1024))
+            if not chunk:
+                break
+            left -= len(chunk)
+
+        self.reply(json.dumps({"uuid": "upload", "size": size}).encode())
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    request_queue_size = 128
+
+
+Server(("127.0.0.1", port), Handler).serve_forever()
@@ -0,0 +1,235 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "../transport.h"
+
+/*
+ * Mixed listings and uploads benchmark.
+ *
+ * Listers page through the tracks while uploaders send files for as long as
+ * they run, each with its own copy of the transport, once through plain curl
+ * transports (a connection each), once through the scheduled one over
+ * HTTP/1.1 and once in its HTTP/2 mode. Run it against bench/nghttpx.conf,
+ * which speaks both on the same port.
+ */
+typedef struct worker {
+    fw_transport transport;
+    pthread_t thread;
+    bool upload;
+
+    size_t count;    // listings to make
+    long *latencies; // of the listings, in us
+    size_t done;     // listings or uploads
+    size_t bytes;    // uploaded
+    bool ok;
+} worker;
+
+static const char *modes[] = {"curl", "sched", "h2"};
+
+static char *upload_body;
+static size_t upload_size = 4*1024*1024;
+static atomic_bool listing;
+
+static long
+now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+    return *(const long*)a < *(const long*)b ? -1 : *(const long*)a > *(const long*)b;
+}
+
+static void*
+work(void *arg)
+{
+    worker *w = arg;
+    char target[64];
+
+    w->ok = true;
+
+    while (w->ok && (w->upload ? atomic_load(&listing) : w->done < w->count)) {
+        fw_http_request req = {"POST", "/api/v1/uploads", NULL, upload_body, upload_size, .priority = FW_PRIO_BULK};
+        fw_http_response resp = {0};
+        long start = now_us();
+
+        if (!w->upload) {
+            snprintf(target, sizeof(target), "/api/v1/tracks?page=%zu", w->done % 20 + 1);
+            req = (fw_http_request){"GET", target, .priority = FW_PRIO_INTERACTIVE};
+        }
+
+        if (!(w->ok = w->transport.send(w->transport.impl, &req, &resp) && resp.status < 400))
+            fprintf(stderr, "ERR: %s %s: %s (HTTP %ld)\n", req.method, req.target, resp.error, resp.status);
+        else if (w->upload)
+            w->bytes += upload_size;
+        else
+            w->latencies[w->done] = now_us() - start;
+
+        w->done += w->ok;
+        fw_response_free(&resp);
+    }
+
+    return NULL;
+}
+
+static bool
+open_transport(fw_transport *transport, int mode, const char *server)
+{
+    fw_sched_opts opts = {.http2 = mode == 2};
+
+    if (mode == 0)
+        return fw_curl_transport(transport, "http", server);
+
+    return fw_sched_transport(transport, "http", server, &opts);
+}
+
+static bool
+run(int mode, const char *server, size_t listers, size_t uploaders, size_t count)
+{
+    size_t nworkers = listers + uploaders, nlatencies = listers * count;
+    worker *workers = calloc(sizeof(*workers), nworkers); // Don't forget to free
+    long *latencies = malloc(sizeof(*latencies) * nlatencies); // Don't forget to free
+    size_t i, uploads = 0, bytes = 0;
+    fw_transport transport;
+    long start, end = 0;
+    bool ok = true;
+
+    if (!workers || !latencies || !open_transport(&transport, mode, server)) {
+        fprintf(stderr, "ERR: Couldn't connect to %s in %s mode\n", server, modes[mode]);
+        free(workers);
+        free(latencies);
+        return false;
+    }
+
+    atomic_store(&listing, true);
+    start = now_us();
+
+    for (i = 0; i < nworkers; ++i) {
+        worker *w = &workers[i];
+
+        w->transport = transport;
+        w->upload = i >= listers;
+        w->count = count;
+        w->latencies = latencies + (w->upload ? 0 : i * count);
+
+        if (!(w->transport.impl = transport.dup(transport.impl)) ||
+            pthread_create(&w->thread, NULL, work, w)) {
+            if (w->transport.impl)
+                w->transport.free(w->transport.impl);
+            nworkers = i;
+            ok = false;
+            break;
+        }
+    }
+
+    for (i = 0; i < nworkers; ++i) {
+        if (i == listers) {
+            end = now_us();
+            atomic_store(&listing, false);
+        }
+
+        pthread_join(workers[i].thread, NULL);
+        workers[i].transport.free(workers[i].transport.impl);
+        ok &= workers[i].ok && (workers[i].upload || workers[i].done == count);
+
+        if (workers[i].upload) {
+            uploads += workers[i].done;
+            bytes += workers[i].bytes;
+        }
+    }
+
+    // The listings are timed up to the last lister, the uploads to the end
+    if (!end)
+        end = now_us();
+
+    atomic_store(&listing, false);
+    transport.free(transport.impl);
+
+    if (ok) {
+        qsort(latencies, nlatencies, sizeof(*latencies), latency_cmp);
+        printf("%-6s %5zu listings %6.0f/s  p50 %5.1f  p95 %5.1f  p99 %5.1f ms  "
+               "%3zu uploads %6.1f MB/s\n", modes[mode],
+               nlatencies, nlatencies / ((end - start) / 1e6),
+               latencies[nlatencies / 2] / 1e3, latencies[nlatencies * 95 / 100] / 1e3,
+               latencies[nlatencies * 99 / 100] / 1e3,
+               uploads, bytes / ((now_us() - start) / 1e6) / (1024*1024));
+    }
+
+    free(workers);
+    free(latencies);
+
+    return ok;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m mode] [-l listers] [-u uploaders] [-n listings] [-b bytes] server\n", name);
+    fprintf(stderr, "    -m  curl, sched or h2, all three by default\n");
+    fprintf(stderr, "    -l  threads paging through the tracks, 16 by default\n");
+    fprintf(stderr, "    -u  threads uploading meanwhile, 2 by default\n");
+    fprintf(stderr, "    -n  listings per thread, 50 by default\n");
+    fprintf(stderr, "    -b  size of an upload, 4 MiB by default\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t listers = 16, uploaders = 2, count = 50;
+    int mode = -1, opt, i;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "m:l:u:n:b:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                for (mode = 2; mode >= 0 && strcmp(optarg, modes[mode]); --mode);
+                if (mode < 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'l': listers = strtoul(optarg, NULL, 10); break;
+            case 'u': uploaders = strtoul(optarg, NULL, 10); break;
+            case 'n': count = strtoul(optarg, NULL, 10); break;
+            case 'b': upload_size = strtoul(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind + 1 != argc || !listers || !count) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!(upload_body = calloc(upload_size ? upload_size : 1, 1)))
+        return 1;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    for (i = 0; i < 3; ++i)
+        if (mode < 0 || mode == i)
+            ok &= run(i, argv[optind], listers, uploaders, count);
+
+    curl_global_cleanup();
+    free(upload_body);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "../urlencode.h"
+#include "../transport.h"
+#include "../funkwhale.h"
+
+/*
+ * Hedged GETs benchmark.
+ *
+ * Runs the same listings with and without fw_set_hedging against
+ * bench/stall_server.py, which stalls a few of the requests, and prints the
+ * latency percentiles of each run. The first GETs only fill the p95 samples
+ * and aren't counted.
+ */
+#define WARMUP 32
+
+static long
+now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+    return *(const long*)a < *(const long*)b ? -1 : *(const long*)a > *(const long*)b;
+}
+
+static bool
+run(const char *name, const char *scheme, const char *server, bool http2, bool hedging, size_t count)
+{
+    fw_sched_opts opts = {.http2 = http2};
+    fw_transport transport;
+    funkctx *ctx;
+    long *latencies = malloc(sizeof(*latencies) * count); // Don't forget to free
+    long start;
+    size_t i;
+
+    if (!latencies || !fw_sched_transport(&transport, scheme, server, &opts)) {
+        free(latencies);
+        return false;
+    }
+
+    if (!(ctx = fw_init_transport(scheme, server, transport))) {
+        transport.free(transport.impl);
+        free(latencies);
+        return false;
+    }
+
+    fw_set_hedging(ctx, hedging);
+
+    for (i = 0; i < WARMUP; ++i)
+        fw_get(ctx, FW_ARTISTS, NULL);
+
+    for (i = 0; i < count; ++i) {
+        start = now_ms();
+
+        if (!fw_get(ctx, FW_ARTISTS, NULL)) {
+            fprintf(stderr, "ERR: %s\n", fw_error_str(ctx));
+            break;
+        }
+
+        latencies[i] = now_ms() - start;
+    }
+
+    if (i == count) {
+        qsort(latencies, count, sizeof(*latencies), latency_cmp);
+        printf("%-8s p50 %4ld ms  p95 %4ld ms  p99 %4ld ms  max %4ld ms\n", name,
+               latencies[count / 2], latencies[count * 95 / 100],
+               latencies[count * 99 / 100], latencies[count - 1]);
+    }
+
+    fw_free(ctx);
+    free(latencies);
+
+    return i == count;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *scheme = "http";
+    bool http2 = false;
+    size_t count = 256;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "2s:n:")) != -1) {
+        switch (opt) {
+            case '2': http2 = true; break;
+            case 's': scheme = optarg; break;
+            case 'n': count = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-2] [-s scheme] [-n count] server\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind + 1 != argc || !count) {
+        fprintf(stderr, "usage: %s [-2] [-s scheme] [-n count] server\n", argv[0]);
+        return 2;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    url_enc_init();
+
+    if (!run("plain", scheme, argv[optind], http2, false, count) ||
+        !run("hedged", scheme, argv[optind], http2, true, count))
+        return 1;
+
+    curl_global_cleanup();
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# A listing server stalling one request out of ``every`` for ``stall``
+# seconds, for bench/hedge.c.
+#
+#     bench/stall_server.py [port] [every] [stall]
+
+import http.server
+import socketserver
+import sys
+import threading
+import time
+
+port = int(sys.argv[1]) if len(sys.argv) > 1 else 8767
+every = int(sys.argv[2]) if len(sys.argv) > 2 else 32
+stall = float(sys.argv[3]) if len(sys.argv) > 3 else 2.0
+
+count = 0
+lock = threading.Lock()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        global count
+
+        with lock:
+            count += 1
+            n = count
+
+        time.sleep(stall if n % every == 0 else 0.005)
+
+        body = b'{"next":null,"results":[{"id":1,"name":"A"}]}'
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+Server(("127.0.0.1", port), Handler).serve_forever()
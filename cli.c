@@ -0,0 +1,392 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "urlencode.h"
+#include "transport.h"
+#include "funkwhale.h"
+#include "json.h"
+
+/*
+ * Batch client.
+ *
+ * Reads one JSON command per line from a file or stdin:
+ *
+ *     {"id": 1, "op": "list", "type": "artists"}
+ *     {"id": 2, "op": "search", "type": "tracks", "q": "intro"}
+ *     {"op": "upload", "library": "<uuid>", "file": "a.mp3", "cover": "a.jpg",
+ *      "artist": "...", "album": "...", "title": "...", "genre": "...", "track": "1", "year": "2020"}
+ *     {"op": "attach", "file": "cover.jpg", "mime": "image/jpeg"}
+ *     {"op": "create-channel", "name": "...", "username": "...", "description": "...", "cover": "<uuid>"}
+ *
+ * and writes one JSON result per line to stdout, in the order the commands
+ * finish. ``id`` is echoed back as is and ``line`` is the command line:
+ *
+ *     {"id":1,"line":1,"ok":true,"results":[{"id":1,"name":"..."}]}
+ *     {"line":3,"ok":false,"error":"..."}
+ *
+ * The workers share one scheduled transport, so the connections are made
+ * once and the uploads don't hold the listings back.
+ */
+typedef struct cli_job {
+    char *line;
+    size_t lineno;
+} cli_job;
+
+typedef struct cli {
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // a job is queued or the input is over
+    pthread_cond_t room;  // a job is taken
+
+    cli_job *queue; // ring buffer
+    size_t head;
+    size_t count;
+    size_t cap;
+    bool eof;
+
+    pthread_mutex_t out_lock;
+    size_t failed;
+} cli;
+
+typedef struct cli_worker {
+    cli *cli;
+    funkctx *ctx;
+    pthread_t thread;
+} cli_worker;
+
+static const struct {
+    const char *name;
+    fw_request_type type;
+} listings[] = {
+    {"artists",    FW_ARTISTS},
+    {"albums",     FW_ALBUMS},
+    {"tracks",     FW_TRACKS},
+    {"libraries",  FW_LIBRARIES},
+    {"uploads",    FW_UPLOADS},
+    {"channels",   FW_CHANNELS},
+    {"favorites",  FW_FAVORITES},
+    {"playlists",  FW_PLAYLISTS},
+    {"listenings", FW_LISTENINGS},
+};
+
+static const char*
+cli_str(const cJSON *cmd, const char *key)
+{
+    const cJSON *value = json_getobj(cmd, key);
+
+    return json_isstr(value) ? value->valuestring : "";
+}
+
+static bool
+cli_run(funkctx *ctx, const cJSON *cmd, char *error, size_t size)
+{
+    const char *op = cli_str(cmd, "op");
+    bool ok;
+
+    if (!strcmp(op, "list") || !strcmp(op, "search")) {
+        const char *type = cli_str(cmd, "type");
+        size_t i;
+
+        for (i = 0; i < sizeof(listings) / sizeof(*listings) && strcmp(listings[i].name, type); ++i);
+
+        if (i == sizeof(listings) / sizeof(*listings)) {
+            snprintf(error, size, "unknown type \"%s\"", type);
+            return false;
+        }
+
+        ok = fw_get(ctx, listings[i].type, cli_str(cmd, "q"));
+    }
+    else if (!strcmp(op, "upload")) {
+        fw_track_tags tags = {0};
+
+        snprintf(tags.track_file, sizeof(tags.track_file), "%s", cli_str(cmd, "file"));
+        snprintf(tags.cover_file, sizeof(tags.cover_file), "%s", cli_str(cmd, "cover"));
+        snprintf(tags.artist, sizeof(tags.artist), "%s", cli_str(cmd, "artist"));
+        snprintf(tags.album, sizeof(tags.album), "%s", cli_str(cmd, "album"));
+        snprintf(tags.title, sizeof(tags.title), "%s", cli_str(cmd, "title"));
+        snprintf(tags.genre, sizeof(tags.genre), "%s", cli_str(cmd, "genre"));
+        snprintf(tags.track, sizeof(tags.track), "%s", cli_str(cmd, "track"));
+        snprintf(tags.year, sizeof(tags.year), "%s", cli_str(cmd, "year"));
+
+        ok = fw_upload_track(ctx, cli_str(cmd, "library"), &tags);
+    }
+    else if (!strcmp(op, "attach")) {
+        FILE *file = fopen(cli_str(cmd, "file"), "r"); // Don't forget to close
+
+        if (!file) {
+            snprintf(error, size, "%s: %s", cli_str(cmd, "file"), strerror(errno));
+            return false;
+        }
+
+        ok = fw_attach(ctx, file, cli_str(cmd, "mime"));
+        fclose(file);
+    }
+    else if (!strcmp(op, "create-channel")) {
+        fw_channel channel = {
+            .name = (char*)cli_str(cmd, "name"),
+            .username = (char*)cli_str(cmd, "username"),
+            .descx = (char*)cli_str(cmd, "description"),
+            .cover_id = (char*)cli_str(cmd, "cover"),
+        };
+
+        ok = fw_create_channel(ctx, &channel);
+    }
+    else {
+        snprintf(error, size, "unknown op \"%s\"", op);
+        return false;
+    }
+
+    if (!ok)
+        snprintf(error, size, "%s", fw_error_str(ctx));
+
+    return ok;
+}
+
+static void
+cli_output(cli *c, const cJSON *cmd, size_t lineno, bool ok, const char *results, const char *error)
+{
+    const cJSON *id = json_getobj(cmd, "id");
+    char *id_str = id ? json_print_raw(id) : NULL; // Don't forget to free
+    char *error_str = NULL;
+
+    if (!ok) {
+        cJSON *str = json_create_string(error);
+
+        error_str = json_print_raw(str); // Don't forget to free
+        json_delete(str);
+    }
+
+    pthread_mutex_lock(&c->out_lock);
+
+    printf("{");
+    if (id_str)
+        printf("\"id\":%s,", id_str);
+    printf("\"line\":%zu,\"ok\":%s", lineno, ok ? "true" : "false");
+    if (ok)
+        printf(",\"results\":%s", results ? results : "[]");
+    else
+        printf(",\"error\":%s", error_str ? error_str : "\"\"");
+    printf("}\n");
+    fflush(stdout);
+
+    c->failed += !ok;
+
+    pthread_mutex_unlock(&c->out_lock);
+
+    free(id_str);
+    free(error_str);
+}
+
+static void*
+cli_work(void *arg)
+{
+    cli_worker *w = arg;
+    cli *c = w->cli;
+    cli_job job;
+
+    for (;;) {
+        cJSON *cmd;
+        char error[CURL_ERROR_SIZE] = "invalid command";
+        char *results = NULL;
+        bool ok = false;
+
+        pthread_mutex_lock(&c->lock);
+
+        while (!c->count && !c->eof)
+            pthread_cond_wait(&c->ready, &c->lock);
+
+        if (!c->count) {
+            pthread_mutex_unlock(&c->lock);
+            break;
+        }
+
+        job = c->queue[c->head];
+        c->head = (c->head + 1) % c->cap;
+        c->count--;
+
+        pthread_cond_signal(&c->room);
+        pthread_mutex_unlock(&c->lock);
+
+        cmd = json_parse(job.line); // Don't forget to free
+
+        if (cmd && (ok = cli_run(w->ctx, cmd, error, sizeof(error))))
+            results = fw_results_json(w->ctx);
+
+        cli_output(c, cmd, job.lineno, ok, results, error);
+
+        free(results);
+        json_delete(cmd);
+        free(job.line);
+    }
+
+    return NULL;
+}
+
+static void
+cli_push(cli *c, char *line, size_t lineno)
+{
+    pthread_mutex_lock(&c->lock);
+
+    while (c->count == c->cap)
+        pthread_cond_wait(&c->room, &c->lock);
+
+    c->queue[(c->head + c->count++) % c->cap] = (cli_job){line, lineno};
+
+    pthread_cond_signal(&c->ready);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-2] [-s scheme] [-t token] [-j jobs] [-c cache] server [file]\n", name);
+    fprintf(stderr, "    -2  multiplex the commands over one HTTP/2 connection\n");
+    fprintf(stderr, "    -s  https (default) or http\n");
+    fprintf(stderr, "    -t  user token, $FUNKWHALE_TOKEN by default\n");
+    fprintf(stderr, "    -j  commands run at once, 4 by default\n");
+    fprintf(stderr, "    -c  file to keep TLS sessions, HSTS and Alt-Svc in across runs\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *scheme = "https";
+    const char *token = getenv("FUNKWHALE_TOKEN");
+    const char *server;
+    long jobs = 4;
+    fw_sched_opts opts = {0};
+    fw_transport transport;
+    cli_worker *workers;
+    cli c = {0};
+    FILE *input = stdin;
+    char *line = NULL;
+    size_t cap = 0, lineno = 0;
+    long i, started = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "2s:t:j:c:h")) != -1) {
+        switch (opt) {
+            case '2': opts.http2 = true; break;
+            case 's': scheme = optarg; break;
+            case 't': token = optarg; break;
+            case 'j': jobs = strtol(optarg, NULL, 10); break;
+            case 'c': opts.cache_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind >= argc || jobs < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    server = argv[optind++];
+
+    if (optind < argc && !(input = fopen(argv[optind], "r"))) {
+        fprintf(stderr, "ERR: %s: %s\n", argv[optind], strerror(errno));
+        return 2;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    url_enc_init();
+
+    // Uploads share the connections with the rest, but never all of them
+    opts.max_active = jobs + 1;
+
+    if (!fw_sched_transport(&transport, scheme, server, &opts)) {
+        fprintf(stderr, "ERR: Couldn't connect to %s://%s\n", scheme, server);
+        return 2;
+    }
+
+    pthread_mutex_init(&c.lock, NULL);
+    pthread_mutex_init(&c.out_lock, NULL);
+    pthread_cond_init(&c.ready, NULL);
+    pthread_cond_init(&c.room, NULL);
+    c.cap = jobs * 4;
+    c.queue = malloc(sizeof(*c.queue) * c.cap); // Don't forget to free
+    workers = calloc(sizeof(*workers), jobs); // Don't forget to free
+
+    if (!c.queue || !workers) {
+        fprintf(stderr, "ERR: Out of memory\n");
+        return 2;
+    }
+
+    // One context per worker, all of them over the same transport
+    for (i = 0; i < jobs; ++i) {
+        fw_transport copy = transport;
+
+        workers[i].cli = &c;
+
+        if (!(copy.impl = transport.dup(transport.impl)))
+            break;
+
+        if (!(workers[i].ctx = fw_init_transport(scheme, server, copy))) {
+            copy.free(copy.impl);
+            break;
+        }
+
+        if (token)
+            fw_set_user_token(workers[i].ctx, token);
+
+        if (pthread_create(&workers[i].thread, NULL, cli_work, &workers[i])) {
+            fw_free(workers[i].ctx);
+            break;
+        }
+
+        started++;
+    }
+
+    if (!started) {
+        fprintf(stderr, "ERR: Couldn't start the workers\n");
+        return 2;
+    }
+
+    while (getline(&line, &cap, input) > 0) {
+        ++lineno;
+
+        if (strspn(line, " \t\r\n") == strlen(line))
+            continue;
+
+        cli_push(&c, line, lineno); // The worker frees the line
+        line = NULL;
+        cap = 0;
+    }
+
+    free(line);
+
+    pthread_mutex_lock(&c.lock);
+    c.eof = true;
+    pthread_cond_broadcast(&c.ready);
+    pthread_mutex_unlock(&c.lock);
+
+    for (i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        fw_free(workers[i].ctx);
+    }
+
+    transport.free(transport.impl);
+
+    if (input != stdin)
+        fclose(input);
+
+    free(workers);
+    free(c.queue);
+    pthread_cond_destroy(&c.room);
+    pthread_cond_destroy(&c.ready);
+    pthread_mutex_destroy(&c.out_lock);
+    pthread_mutex_destroy(&c.lock);
+
+    curl_global_cleanup();
+
+    return c.failed ? 1 : 0;
+}
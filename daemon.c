@@ -0,0 +1,763 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE // struct ucred
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <curl/curl.h>
+
+#include "transport.h"
+#include "funkwhale.h"
+#include "daemon.h"
+
+/*
+ * Local daemon.
+ *
+ * The daemon owns the connections, the caches and the authorization. Its
+ * clients are transports: a context made with fw_init_daemon keeps the whole
+ * API and only the HTTP exchanges go over the socket. Both ends are on the
+ * same host, so the frames are in the native byte order:
+ *
+ *     request:  fwd_request, method, target, header lines, body
+ *     response: fwd_response, header lines, body, error
+ *
+ * A file body isn't copied, its descriptor goes along with the request
+ * (SCM_RIGHTS) and the daemon reads it from the given offset. Identical GETs
+ * in flight at the same time are sent once and the response is shared.
+ */
+#define FWD_MAGIC       0x31647766 // "fwd1"
+#define FWD_MAX_METHOD  16
+#define FWD_MAX_TARGET  (8*1024)
+#define FWD_MAX_HEADERS (64*1024)
+#define FWD_MAX_BODY    (64*1024*1024) // larger bodies are passed as files
+
+typedef struct fwd_request {
+    uint32_t magic;
+    int32_t priority;
+    int64_t timeout_ms;
+    uint32_t method_size;
+    uint32_t target_size;
+    uint32_t headers_size; // "\r\n" terminated lines
+    uint32_t body_size;    // of the inline body
+    uint64_t file_size;    // to be read from the passed descriptor
+    int64_t file_offset;
+    uint8_t has_file;
+} fwd_request;
+
+typedef struct fwd_response {
+    uint32_t magic;
+    uint8_t ok;
+    int64_t status;
+    uint32_t headers_size;
+    uint64_t body_size;
+    uint32_t error_size;
+} fwd_response;
+
+static bool
+io_write(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool
+io_read(int fd, void *data, size_t size)
+{
+    char *p = data;
+
+    while (size) {
+        ssize_t n = recv(fd, p, size, 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// Reads ``size`` bytes at the end of ``buf``
+static bool
+io_read_buf(int fd, fw_buf *buf, size_t size)
+{
+    char chunk[64*1024];
+
+    while (size) {
+        size_t n = size < sizeof(chunk) ? size : sizeof(chunk);
+
+        if (!io_read(fd, chunk, n) || !buf_append(buf, chunk, n))
+            return false;
+
+        size -= n;
+    }
+
+    return true;
+}
+
+// The first bytes of a frame, with a descriptor if ``fd_out`` is not -1
+static bool
+io_write_head(int fd, const void *data, size_t size, int fd_out)
+{
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {(void*)data, size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    ssize_t n;
+
+    if (fd_out >= 0) {
+        struct cmsghdr *cmsg;
+
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd_out, sizeof(int));
+    }
+
+    while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+
+    // The descriptor went with the first byte, the rest is a plain write
+    return n > 0 && io_write(fd, (const char*)data + n, size - n);
+}
+
+static bool
+io_read_head(int fd, void *data, size_t size, int *fd_in)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {data, size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    *fd_in = -1;
+
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+
+    if (n <= 0)
+        return false;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd_in, CMSG_DATA(cmsg), sizeof(int));
+
+    return io_read(fd, (char*)data + n, size - n);
+}
+
+static int
+io_connect(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * Daemon side
+ */
+typedef struct fwd_flight {
+    char *key; // target and headers
+    fw_http_response resp;
+    bool ok;
+    bool done;
+    size_t refs;
+    struct fwd_flight *next;
+} fwd_flight;
+
+typedef struct fwd_conn {
+    struct fw_daemon *d;
+    int fd;
+    struct fwd_conn *next;
+} fwd_conn;
+
+struct fw_daemon {
+    funkctx *ctx;
+    int fd;
+    char path[108];
+    pthread_t acceptor;
+
+    pthread_mutex_t lock;
+    pthread_cond_t landed; // a GET in flight is done
+    pthread_cond_t idle;   // a client is gone
+    bool stop;
+
+    fwd_conn *conns;
+    fwd_flight *flights;
+};
+
+static bool
+response_copy(fw_http_response *to, const fw_http_response *from)
+{
+    to->status = from->status;
+    memcpy(to->error, from->error, sizeof(to->error));
+
+    return buf_append(&to->headers, from->headers.data, from->headers.size)
+        && buf_append(&to->body, from->body.data, from->body.size);
+}
+
+// Joins the same GET if it's already in flight
+static bool
+daemon_get(fw_daemon *d, fw_transport *transport, fw_http_request *req, struct curl_slist *headers,
+           const char *key, fw_http_response *resp)
+{
+    fwd_flight *f, **p;
+    bool ok;
+
+    pthread_mutex_lock(&d->lock);
+
+    for (f = d->flights; f && strcmp(f->key, key); f = f->next);
+
+    if (f) {
+        f->refs++;
+
+        while (!f->done)
+            pthread_cond_wait(&d->landed, &d->lock);
+
+        ok = response_copy(resp, &f->resp) && f->ok;
+
+        if (!--f->refs) {
+            fw_response_free(&f->resp);
+            free(f->key);
+            free(f);
+        }
+
+        pthread_mutex_unlock(&d->lock);
+
+        return ok;
+    }
+
+    if ((f = calloc(sizeof(*f), 1)) && !(f->key = strdup(key))) {
+        free(f);
+        f = NULL;
+    }
+
+    if (f) {
+        f->refs = 1;
+        f->next = d->flights;
+        d->flights = f;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    ok = fw_forward(d->ctx, transport, req, headers, resp);
+
+    if (!f)
+        return ok;
+
+    pthread_mutex_lock(&d->lock);
+
+    // Nobody can join it from now on
+    for (p = &d->flights; *p != f; p = &(*p)->next);
+    *p = f->next;
+
+    if (f->refs > 1)
+        f->ok = response_copy(&f->resp, resp) && ok;
+
+    f->done = true;
+    pthread_cond_broadcast(&d->landed);
+
+    if (!--f->refs) {
+        fw_response_free(&f->resp);
+        free(f->key);
+        free(f);
+    }
+
+    pthread_mutex_unlock(&d->lock);
+
+    return ok;
+}
+
+static bool
+daemon_reply(int fd, bool ok, const fw_http_response *resp)
+{
+    fwd_response head = {
+        .magic = FWD_MAGIC,
+        .ok = ok,
+        .status = resp->status,
+        .headers_size = resp->headers.size,
+        .body_size = resp->body.size,
+        .error_size = strlen(resp->error),
+    };
+
+    return io_write_head(fd, &head, sizeof(head), -1)
+        && io_write(fd, resp->headers.data, resp->headers.size)
+        && io_write(fd, resp->body.data, resp->body.size)
+        && io_write(fd, resp->error, head.error_size);
+}
+
+// One request of a client, false if the connection is to be closed
+static bool
+daemon_serve(fw_daemon *d, fw_transport *transport, int fd)
+{
+    fwd_request head;
+    fw_http_request req = {0};
+    fw_http_response resp = {0};
+    fw_buf strings = {0};
+    struct curl_slist *headers = NULL;
+    FILE *file = NULL;
+    char *key = NULL;
+    char *line, *end;
+    int file_fd;
+    bool ok, sent;
+
+    if (!io_read_head(fd, &head, sizeof(head), &file_fd))
+        return false;
+
+    // Each one is capped, so their sums can't wrap
+    ok = head.magic == FWD_MAGIC && head.method_size <= FWD_MAX_METHOD
+        && head.target_size <= FWD_MAX_TARGET && head.headers_size <= FWD_MAX_HEADERS
+        && head.body_size <= FWD_MAX_BODY && (file_fd >= 0) == !!head.has_file;
+
+    // Method, target, headers and body, each one NUL-terminated
+    ok = ok && io_read_buf(fd, &strings, head.method_size) && buf_append(&strings, "", 1)
+        && io_read_buf(fd, &strings, head.target_size) && buf_append(&strings, "", 1)
+        && io_read_buf(fd, &strings, head.headers_size) && buf_append(&strings, "", 1)
+        && io_read_buf(fd, &strings, head.body_size) && buf_append(&strings, "", 1);
+
+    if (!ok) {
+        if (file_fd >= 0)
+            close(file_fd);
+        buf_free(&strings);
+        return false;
+    }
+
+    req.method = strings.data;
+    req.target = req.method + head.method_size + 1;
+    line = (char*)req.target + head.target_size + 1;
+    req.body = line + head.headers_size + 1;
+    req.body_size = head.body_size;
+    req.timeout_ms = head.timeout_ms;
+    req.priority = head.priority;
+
+    // The target and the headers tell the GETs apart
+    if (!strcmp(req.method, "GET") && !req.body_size && file_fd < 0 && (key = malloc(head.target_size + head.headers_size + 2))) {
+        memcpy(key, req.target, head.target_size);
+        key[head.target_size] = '\n';
+        memcpy(key + head.target_size + 1, line, head.headers_size + 1);
+    }
+
+    for (; (end = strstr(line, "\r\n")); line = end + 2) {
+        struct curl_slist *more;
+
+        *end = '\0';
+
+        if ((more = curl_slist_append(headers, line)))
+            headers = more;
+    }
+
+    if (file_fd >= 0) {
+        if ((file = fdopen(file_fd, "r")) && !fseeko(file, head.file_offset, SEEK_SET)) {
+            req.body_file = file;
+            req.body_size = head.file_size;
+        }
+        else {
+            snprintf(resp.error, sizeof(resp.error), "Couldn't read the file of the request");
+        }
+
+        if (!file)
+            close(file_fd);
+    }
+
+    if (*resp.error) {
+        ok = false;
+    }
+    else if (key) {
+        ok = daemon_get(d, transport, &req, headers, key, &resp);
+    }
+    else {
+        ok = fw_forward(d->ctx, transport, &req, headers, &resp);
+    }
+
+    sent = daemon_reply(fd, ok, &resp);
+
+    if (file)
+        fclose(file);
+
+    free(key);
+    curl_slist_free_all(headers);
+    fw_response_free(&resp);
+    buf_free(&strings);
+
+    return sent;
+}
+
+static void*
+daemon_client(void *arg)
+{
+    fwd_conn *conn = arg, **p;
+    fw_daemon *d = conn->d;
+    fw_transport transport; // Own copy, they are per thread
+
+    if (fw_copy_transport(d->ctx, &transport)) {
+        while (daemon_serve(d, &transport, conn->fd));
+        transport.free(transport.impl);
+    }
+
+    pthread_mutex_lock(&d->lock);
+
+    for (p = &d->conns; *p != conn; p = &(*p)->next);
+    *p = conn->next;
+
+    close(conn->fd);
+    free(conn);
+
+    pthread_cond_broadcast(&d->idle);
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+// Whoever connects acts with the daemon token, so only its user may
+static bool
+peer_is_owner(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return !getpeereid(fd, &uid, &gid) && uid == geteuid();
+#endif
+}
+
+static void*
+daemon_acceptor(void *arg)
+{
+    fw_daemon *d = arg;
+    int fd;
+
+    while ((fd = accept(d->fd, NULL, NULL)) >= 0 || errno == EINTR || errno == ECONNABORTED) {
+        fwd_conn *conn;
+        pthread_t thread;
+        pthread_attr_t attr;
+        bool started;
+
+        if (fd < 0)
+            continue;
+
+        if (!peer_is_owner(fd)) {
+            close(fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&d->lock);
+
+        if (d->stop || !(conn = calloc(sizeof(*conn), 1))) {
+            pthread_mutex_unlock(&d->lock);
+            close(fd);
+            continue;
+        }
+
+        conn->d = d;
+        conn->fd = fd;
+        conn->next = d->conns;
+        d->conns = conn;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        started = !pthread_create(&thread, &attr, daemon_client, conn);
+        pthread_attr_destroy(&attr);
+
+        if (!started) {
+            d->conns = conn->next;
+            close(fd);
+            free(conn);
+        }
+
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    return NULL;
+}
+
+fw_daemon*
+fw_daemon_start(funkctx *ctx, const char *socket_path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st;
+    fw_daemon *d;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path) || !(d = calloc(sizeof(*d), 1))) // Don't forget to stop
+        return NULL;
+
+    strcpy(addr.sun_path, socket_path);
+    snprintf(d->path, sizeof(d->path), "%s", socket_path);
+    d->ctx = ctx;
+
+    // A socket left by a previous run, which nobody listens on anymore.
+    // Anything else there is not ours to remove.
+    if (!lstat(socket_path, &st)) {
+        if (S_ISSOCK(st.st_mode) && (fd = io_connect(socket_path)) >= 0)
+            close(fd);
+        else if (S_ISSOCK(st.st_mode) && errno == ECONNREFUSED)
+            unlink(socket_path);
+
+        if (!lstat(socket_path, &st)) {
+            free(d);
+            return NULL;
+        }
+    }
+
+    if ((d->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        free(d);
+        return NULL;
+    }
+
+    // Nobody can connect before the listen, so the mode is set in time.
+    // The peers are checked as well, the mode isn't honoured everywhere.
+    if (bind(d->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(d->fd);
+        free(d);
+        return NULL;
+    }
+
+    if (chmod(socket_path, S_IRUSR | S_IWUSR) || listen(d->fd, 64)) {
+        close(d->fd);
+        unlink(socket_path);
+        free(d);
+        return NULL;
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->landed, NULL);
+    pthread_cond_init(&d->idle, NULL);
+
+    if (pthread_create(&d->acceptor, NULL, daemon_acceptor, d)) {
+        pthread_cond_destroy(&d->idle);
+        pthread_cond_destroy(&d->landed);
+        pthread_mutex_destroy(&d->lock);
+        close(d->fd);
+        unlink(d->path);
+        free(d);
+        return NULL;
+    }
+
+    return d;
+}
+
+// The requests being served are finished first
+void
+fw_daemon_stop(fw_daemon *d)
+{
+    fwd_conn *conn;
+
+    pthread_mutex_lock(&d->lock);
+    d->stop = true;
+    pthread_mutex_unlock(&d->lock);
+
+    shutdown(d->fd, SHUT_RDWR);
+    pthread_join(d->acceptor, NULL);
+    close(d->fd);
+    unlink(d->path);
+
+    pthread_mutex_lock(&d->lock);
+
+    // No more requests are read, the replies still go out
+    for (conn = d->conns; conn; conn = conn->next)
+        shutdown(conn->fd, SHUT_RD);
+
+    while (d->conns)
+        pthread_cond_wait(&d->idle, &d->lock);
+
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_cond_destroy(&d->idle);
+    pthread_cond_destroy(&d->landed);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+/*
+ * Client side
+ */
+typedef struct fwd_client {
+    int fd;
+    char path[108];
+} fwd_client;
+
+static bool
+client_send(void *impl, const fw_http_request *req, fw_http_response *resp)
+{
+    fwd_client *c = impl;
+    const struct curl_slist *header;
+    fw_buf lines = {0};
+    fwd_request head = {
+        .magic = FWD_MAGIC,
+        .priority = req->priority,
+        .timeout_ms = req->timeout_ms,
+        .method_size = strlen(req->method),
+        .target_size = strlen(req->target),
+    };
+    fwd_response reply;
+    long left = fw_cancel_left_ms(req->cancel);
+    int file_fd = -1;
+    bool ok = true;
+
+    // The daemon only gets the deadline, cancelling stops at the socket
+    if (fw_cancelled(req->cancel)) {
+        snprintf(resp->error, sizeof(resp->error), "%s", fw_cancel_reason(req->cancel));
+        return false;
+    }
+
+    if (left >= 0 && (!head.timeout_ms || left < head.timeout_ms))
+        head.timeout_ms = left ? left : 1;
+
+    for (header = req->headers; ok && header; header = header->next)
+        ok = buf_append(&lines, header->data, strlen(header->data)) && buf_append(&lines, "\r\n", 2);
+
+    head.headers_size = lines.size;
+
+    // The daemon would drop the connection on it
+    if (head.method_size > FWD_MAX_METHOD || head.target_size > FWD_MAX_TARGET || lines.size > FWD_MAX_HEADERS) {
+        buf_free(&lines);
+        snprintf(resp->error, sizeof(resp->error), "The request is too large for the daemon");
+        return false;
+    }
+
+    if (req->body_file) {
+        // Whatever the stream buffered, the descriptor has to be where it reads
+        fflush(req->body_file);
+
+        head.has_file = 1;
+        head.file_size = req->body_size;
+        head.file_offset = ftello(req->body_file);
+        file_fd = fileno(req->body_file);
+        ok = ok && head.file_offset >= 0 && file_fd >= 0;
+    }
+    else {
+        head.body_size = req->body_size;
+        ok = ok && req->body_size <= FWD_MAX_BODY;
+    }
+
+    ok = ok && c->fd >= 0
+        && io_write_head(c->fd, &head, sizeof(head), file_fd)
+        && io_write(c->fd, req->method, head.method_size)
+        && io_write(c->fd, req->target, head.target_size)
+        && io_write(c->fd, lines.data, lines.size)
+        && io_write(c->fd, req->body, head.body_size);
+
+    buf_free(&lines);
+
+    ok = ok && io_read_head(c->fd, &reply, sizeof(reply), &file_fd) && reply.magic == FWD_MAGIC
+        && io_read_buf(c->fd, &resp->headers, reply.headers_size)
+        && io_read_buf(c->fd, &resp->body, reply.body_size)
+        && reply.error_size < sizeof(resp->error)
+        && io_read(c->fd, resp->error, reply.error_size);
+
+    if (!ok) {
+        // Out of step with the daemon, the connection can't be used anymore
+        if (c->fd >= 0)
+            close(c->fd);
+        c->fd = -1;
+        snprintf(resp->error, sizeof(resp->error), "Lost the connection to the daemon at %s", c->path);
+        return false;
+    }
+
+    resp->error[reply.error_size] = '\0';
+    resp->status = reply.status;
+
+    return reply.ok;
+}
+
+static void
+client_free(void *impl)
+{
+    fwd_client *c = impl;
+
+    if (c->fd >= 0)
+        close(c->fd);
+
+    free(c);
+}
+
+static fwd_client*
+client_open(const char *path)
+{
+    fwd_client *c = calloc(sizeof(*c), 1); // Don't forget to free
+
+    if (!c)
+        return NULL;
+
+    snprintf(c->path, sizeof(c->path), "%s", path);
+
+    if ((c->fd = io_connect(path)) < 0) {
+        free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+static void*
+client_dup(void *impl)
+{
+    // A connection per thread, the daemon serves each one on its own
+    return client_open(((fwd_client*)impl)->path);
+}
+
+bool
+fw_daemon_transport(fw_transport *transport, const char *socket_path)
+{
+    fwd_client *c = client_open(socket_path);
+
+    if (!c)
+        return false;
+
+    *transport = (fw_transport){
+        .impl = c,
+        .send = client_send,
+        .dup = client_dup,
+        .free = client_free,
+    };
+
+    return true;
+}
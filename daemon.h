@@ -0,0 +1,21 @@
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#include <stdbool.h>
+
+#include "transport.h"
+#include "funkwhale.h"
+
+typedef struct fw_daemon fw_daemon;
+
+// Serves the requests of the local clients through ``ctx``, its transport has
+// to be usable from several threads (see fw_sched_transport). The socket is
+// only open to the same user. It fails if a daemon still listens on
+// ``socket_path`` or if something else than a socket is there.
+fw_daemon *fw_daemon_start(funkctx *ctx, const char *socket_path);
+void fw_daemon_stop(fw_daemon *d);
+
+// Sends the requests through the daemon listening on ``socket_path``
+bool fw_daemon_transport(fw_transport *transport, const char *socket_path);
+
+#endif // _DAEMON_H
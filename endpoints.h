@@ -0,0 +1,133 @@
+#ifndef _ENDPOINTS_H
+#define _ENDPOINTS_H
+
+/*
+ * Funkwhale API endpoints.
+ *
+ * X(type, method, path, default query, has id, result shape, result fields)
+ *
+ * ``path`` is a printf template when the endpoint takes an id (``%s``).
+ * Static paths are glued with their query at compile time. The shape tells
+ * where the results are: FW_LIST is the paginated ``results`` array,
+ * FW_OBJECT is the response itself and FW_NONE has nothing to decode.
+ */
+#define FW_ENDPOINTS(X) \
+    /* Library and metadata */ \
+    X(FW_ARTISTS,         "GET",    "/api/v1/artists",                "ordering=name&page=1&page_size=10&content_category=music",  0, FW_LIST,   ARTIST) \
+    X(FW_ARTIST,          "GET",    "/api/v1/artists/%s",             "",                                                          1, FW_OBJECT, ARTIST) \
+    X(FW_ALBUMS,          "GET",    "/api/v1/albums",                 "ordering=title&page=1&page_size=10&content_category=music", 0, FW_LIST,   ALBUM) \
+    X(FW_ALBUM,           "GET",    "/api/v1/albums/%s",              "",                                                          1, FW_OBJECT, ALBUM) \
+    X(FW_TRACKS,          "GET",    "/api/v1/tracks",                 "ordering=title&page=1&page_size=10&content_category=music", 0, FW_LIST,   TRACK) \
+    X(FW_TRACK,           "GET",    "/api/v1/tracks/%s",              "",                                                          1, FW_OBJECT, TRACK) \
+    /* Uploading and audio content */ \
+    X(FW_LIBRARIES,       "GET",    "/api/v1/libraries",              "page=1&page_size=10&scope=me",                              0, FW_LIST,   LIBRARY) \
+    X(FW_LIBRARY,         "GET",    "/api/v1/libraries/%s",           "",                                                          1, FW_OBJECT, LIBRARY) \
+    X(FW_LIBRARY_CREATE,  "POST",   "/api/v1/libraries",              "",                                                          0, FW_OBJECT, LIBRARY) \
+    X(FW_LIBRARY_UPDATE,  "POST",   "/api/v1/libraries/%s",           "",                                                          1, FW_OBJECT, LIBRARY) \
+    X(FW_LIBRARY_DELETE,  "DELETE", "/api/v1/libraries/%s",           "",                                                          1, FW_NONE,   LIBRARY) \
+    X(FW_UPLOADS,         "GET",    "/api/v1/uploads",                "ordering=-creation_date&page=1&page_size=10",               0, FW_LIST,   UPLOAD) \
+    X(FW_UPLOAD,          "GET",    "/api/v1/uploads/%s",             "",                                                          1, FW_OBJECT, UPLOAD) \
+    X(FW_UPLOAD_UPDATE,   "PATCH",  "/api/v1/uploads/%s",             "",                                                          1, FW_OBJECT, UPLOAD) \
+    X(FW_UPLOAD_DELETE,   "DELETE", "/api/v1/uploads/%s",             "",                                                          1, FW_NONE,   UPLOAD) \
+    X(FW_ATTACHMENTS,     "POST",   "/api/v1/attachments",            "",                                                          0, FW_OBJECT, ATTACHMENT) /* multipart, see fw_attach */ \
+    /* Channels */ \
+    X(FW_CHANNELS,        "GET",    "/api/v1/channels",               "ordering=creation_date&page=1&page_size=10&subscribed=false&external=false", 0, FW_LIST, CHANNEL) \
+    /* Content curation */ \
+    X(FW_FAVORITES,       "GET",    "/api/v1/favorites/tracks",       "ordering=-creation_date&page=1&page_size=10",               0, FW_LIST,   FAVORITE) \
+    X(FW_FAVORITES_ALL,   "GET",    "/api/v1/favorites/tracks/all",   "",                                                          0, FW_LIST,   FAVORITE_ID) \
+    X(FW_FAVORITE_ADD,    "POST",   "/api/v1/favorites/tracks",       "",                                                          0, FW_OBJECT, FAVORITE_ID) \
+    X(FW_FAVORITE_REMOVE, "POST",   "/api/v1/favorites/tracks/remove","",                                                          0, FW_NONE,   FAVORITE_ID) \
+    X(FW_PLAYLISTS,       "GET",    "/api/v1/playlists",              "ordering=name&page=1&page_size=10&scope=me",                0, FW_LIST,   PLAYLIST) \
+    X(FW_PLAYLIST,        "GET",    "/api/v1/playlists/%s",           "",                                                          1, FW_OBJECT, PLAYLIST) \
+    X(FW_PLAYLIST_CREATE, "POST",   "/api/v1/playlists",              "",                                                          0, FW_OBJECT, PLAYLIST) \
+    X(FW_PLAYLIST_UPDATE, "POST",   "/api/v1/playlists/%s",           "",                                                          1, FW_OBJECT, PLAYLIST) \
+    X(FW_PLAYLIST_DELETE, "DELETE", "/api/v1/playlists/%s",           "",                                                          1, FW_NONE,   PLAYLIST) \
+    X(FW_PLAYLIST_TRACKS, "GET",    "/api/v1/playlists/%s/tracks",    "",                                                          1, FW_LIST,   PLAYLIST_TRACK) \
+    X(FW_PLAYLIST_ADD,    "POST",   "/api/v1/playlists/%s/add",       "",                                                          1, FW_LIST,   PLAYLIST_TRACK) \
+    X(FW_PLAYLIST_MOVE,   "POST",   "/api/v1/playlists/%s/move",      "",                                                          1, FW_NONE,   PLAYLIST_TRACK) \
+    X(FW_PLAYLIST_REMOVE, "POST",   "/api/v1/playlists/%s/remove",    "",                                                          1, FW_NONE,   PLAYLIST_TRACK) \
+    X(FW_PLAYLIST_CLEAR,  "DELETE", "/api/v1/playlists/%s/clear",     "",                                                          1, FW_NONE,   PLAYLIST_TRACK) \
+    /* User activity */ \
+    X(FW_LISTENINGS,      "GET",    "/api/v1/history/listenings",     "ordering=-creation_date&page=1&page_size=10&scope=me",      0, FW_LIST,   LISTENING) \
+    X(FW_LISTENING_ADD,   "POST",   "/api/v1/history/listenings",     "",                                                          0, FW_NONE,   LISTENING) \
+    /* Radios */ \
+    X(FW_RADIO_SESSION,   "POST",   "/api/v1/radios/sessions",        "",                                                          0, FW_OBJECT, RADIO_SESSION) \
+    X(FW_RADIO_TRACK,     "POST",   "/api/v1/radios/tracks",          "",                                                          0, FW_OBJECT, RADIO_TRACK)
+
+/*
+ * Result fields.
+ *
+ * F(type, member of the result node, json key, json key inside of it or NULL)
+ */
+#define FW_FIELDS_ARTIST(F) \
+    F(FW_INT, artist.id,   "id",   NULL) \
+    F(FW_STR, artist.name, "name", NULL)
+
+#define FW_FIELDS_ALBUM(F) \
+    F(FW_INT, album.id,   "id",    NULL) \
+    F(FW_STR, album.name, "title", NULL)
+
+#define FW_FIELDS_TRACK(F) \
+    F(FW_INT, track.id,   "id",    NULL) \
+    F(FW_STR, track.name, "title", NULL)
+
+#define FW_FIELDS_LIBRARY(F) \
+    F(FW_STR, library.id,   "uuid",        NULL) \
+    F(FW_STR, library.name, "name",        NULL) \
+    F(FW_STR, library.desc, "description", NULL)
+
+#define FW_FIELDS_UPLOAD(F) \
+    F(FW_STR, upload.id,       "uuid",          NULL) \
+    F(FW_STR, upload.filename, "filename",      NULL) \
+    F(FW_STR, upload.status,   "import_status", NULL) \
+    F(FW_INT, upload.track_id, "track",         "id") \
+    F(FW_INT, upload.size,     "size",          NULL)
+
+#define FW_FIELDS_ATTACHMENT(F) \
+    F(FW_STR, attachment.id,   "uuid",     NULL) \
+    F(FW_STR, attachment.mime, "mimetype", NULL)
+
+#define FW_FIELDS_CHANNEL(F) \
+    F(FW_STR, channel.id,       "uuid",  NULL) \
+    F(FW_STR, channel.name,     "actor", "name") \
+    F(FW_STR, channel.username, "actor", "preferred_username")
+
+#define FW_FIELDS_FAVORITE(F) \
+    F(FW_INT, favorite.id,       "id",    NULL) \
+    F(FW_INT, favorite.track_id, "track", "id")
+
+#define FW_FIELDS_FAVORITE_ID(F) \
+    F(FW_INT, favorite.id,       "id",    NULL) \
+    F(FW_INT, favorite.track_id, "track", NULL)
+
+#define FW_FIELDS_PLAYLIST(F) \
+    F(FW_INT, playlist.id,           "id",            NULL) \
+    F(FW_STR, playlist.name,         "name",          NULL) \
+    F(FW_STR, playlist.privacy,      "privacy_level", NULL) \
+    F(FW_INT, playlist.tracks_count, "tracks_count",  NULL)
+
+#define FW_FIELDS_PLAYLIST_TRACK(F) \
+    F(FW_INT, playlist_track.index,    "index", NULL) \
+    F(FW_INT, playlist_track.track_id, "track", "id") \
+    F(FW_STR, playlist_track.name,     "track", "title")
+
+#define FW_FIELDS_LISTENING(F) \
+    F(FW_INT, listening.id,       "id",    NULL) \
+    F(FW_INT, listening.track_id, "track", "id")
+
+#define FW_FIELDS_RADIO_SESSION(F) \
+    F(FW_INT, radio_session.id,   "id",         NULL) \
+    F(FW_STR, radio_session.type, "radio_type", NULL)
+
+#define FW_FIELDS_RADIO_TRACK(F) \
+    F(FW_INT, radio_track.position,   "position", NULL) \
+    F(FW_INT, radio_track.track_id,   "track",    "id") \
+    F(FW_STR, radio_track.name,       "track",    "title") \
+    F(FW_STR, radio_track.listen_url, "track",    "listen_url")
+
+#define FW_RESULT_FIELDS(R) \
+    R(ARTIST) R(ALBUM) R(TRACK) R(LIBRARY) R(UPLOAD) R(ATTACHMENT) R(CHANNEL) \
+    R(FAVORITE) R(FAVORITE_ID) R(PLAYLIST) R(PLAYLIST_TRACK) R(LISTENING) \
+    R(RADIO_SESSION) R(RADIO_TRACK)
+
+#endif // _ENDPOINTS_H
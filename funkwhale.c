@@ -0,0 +1,4387 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <curl/curl.h>
+#include <cJSON.h>
+#include "id3v2lib.h"
+
+#include "urlencode.h"
+#include "transport.h"
+#include "endpoints.h"
+#include "funkwhale.h"
+#include "daemon.h"
+#include "json.h"
+
+#define UNUSED(var) do {(void)var;} while (0)
+
+static inline size_t
+fsize(FILE *file)
+{
+    size_t size;
+    size_t pos = ftell(file);
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, pos, SEEK_SET);
+
+    return size;
+}
+
+static inline char*
+gen_str(char *buf, size_t len)
+{
+    size_t i;
+
+    srand(time(NULL));
+
+    for (i = 0; i < len; ++i) {
+        int r = rand() % 52;
+
+        buf[i] = r + (r < 26 ? 'A' : 'a' - 26);
+    }
+
+    buf[i] = '\0';
+
+    return buf;
+}
+
+static inline bool
+file_copy(const char *to, const char *from)
+{
+    int c;
+    bool ok;
+    FILE *to_file = fopen(to, "w");
+    FILE *from_file = fopen(from, "r");
+
+    if (!to_file || !from_file) {
+        if (to_file)
+            fclose(to_file);
+        if (from_file)
+            fclose(from_file);
+        return false;
+    }
+
+    for (; (c = fgetc(from_file)) != EOF;)
+        fputc(c, to_file);
+
+    ok = !ferror(from_file);
+    fclose(from_file);
+
+    return !fclose(to_file) && ok;
+}
+
+// Ready-made header list with the Authorization header. It's shared by all
+// requests of a context and is replaced as a whole when the token changes.
+typedef struct fw_auth {
+    struct curl_slist *headers;
+    size_t refs;
+} fw_auth;
+
+#define TOKEN_SIZE 512
+#define REFRESH_MIN_INTERVAL 30 // seconds between two refreshes, failed or not
+
+// Registered app, never changed once published (see client_set_app)
+typedef struct fw_app {
+    char client_id[512];
+    char client_secret[512];
+    char scope[1024];
+    char redirect_uri[256];
+    char auth_url[3*1024];
+
+    struct fw_app *prev; // replaced, freed along with the client
+} fw_app;
+
+// What the contexts of a client share, see fw_client_new
+struct fw_client {
+    pthread_mutex_t lock;
+    size_t refs; // the one of the client and one by context
+
+    fw_transport transport; // copied into the sessions, impl is NULL for a lone context
+    char url[256];
+    bool https;
+
+    fw_app *app; // NULL until registered
+};
+
+// A user session, its client holds the rest
+typedef struct funkctx {
+    fw_client *client;
+    fw_transport transport;
+    long timeout_ms; // 0 means no timeout
+
+    char error[CURL_ERROR_SIZE];
+
+    struct {
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+
+        fw_auth *current;
+        char *refresh_token; // NULL if none
+        time_t expires; // 0 if the token never expires
+        long lifetime;  // seconds the token was given for
+        long margin;    // seconds before ``expires`` to refresh the token at
+
+        pthread_t refresher;
+        fw_cancel cancel; // of the refresher requests, triggered on stop
+        bool refreshing;
+        bool stop;
+    } auth;
+
+    fw_request_type result_type;
+    fw_metadata_type metadata_type;
+
+    struct list *results;
+
+    const fw_cancel *cancel; // of every request, see fw_set_cancel
+
+    // See hedged_send
+    struct {
+        bool enabled;
+        bool armed;             // the request being made may be hedged
+        struct fw_hedge *state; // NULL until it's enabled
+    } hedge;
+
+    // Favorite track ids as a bitset, see fw_load_favorites
+    struct {
+        uint64_t *bits;
+        size_t nwords;
+        bool loaded;
+    } favorites;
+} funkctx;
+
+typedef enum fw_field_type {
+    FW_INT,
+    FW_STR,
+} fw_field_type;
+
+typedef struct fw_field {
+    fw_field_type type;
+    size_t offset; // in ``struct list``
+    const char *member;
+    const char *key;
+    const char *subkey;
+} fw_field;
+
+typedef enum fw_shape {
+    FW_NONE,
+    FW_OBJECT,
+    FW_LIST,
+} fw_shape;
+
+typedef struct fw_endpoint {
+    const char *method;
+    const char *path;
+    const char *query;
+    const char *target; // ``path?query`` if the path is static, NULL otherwise
+    fw_shape shape;
+
+    const fw_field *fields;
+    size_t nfields;
+} fw_endpoint;
+
+#define F(type, member, key, subkey) {type, offsetof(struct list, member), #member, key, subkey},
+#define R(name) static const fw_field fields_##name[] = { FW_FIELDS_##name(F) };
+FW_RESULT_FIELDS(R)
+#undef R
+#undef F
+
+static const fw_endpoint endpoints[] = {
+#define X(type, method, path, query, has_id, shape, fields) \
+    [type] = {method, path, query, has_id ? NULL : sizeof(query) > 1 ? path "?" query : path, \
+              shape, fields_##fields, sizeof(fields_##fields) / sizeof(*fields_##fields)},
+    FW_ENDPOINTS(X)
+#undef X
+};
+
+static inline const fw_endpoint*
+endpoint(fw_request_type req_type)
+{
+    return req_type > FW_NOTHING && req_type < FW_METADATA ? &endpoints[req_type] : NULL;
+}
+
+static struct list**
+decode_result(const fw_endpoint *ep, const cJSON *json, struct list **resultsp)
+{
+    size_t i;
+
+    if (!(*resultsp = calloc(sizeof(**resultsp), 1)))
+        return resultsp;
+
+    for (i = 0; i < ep->nfields; ++i) {
+        const fw_field *field = &ep->fields[i];
+        const cJSON *value = json_getobj(json, field->key);
+        char *dst = (char*)*resultsp + field->offset;
+
+        if (field->subkey)
+            value = json_getobj(value, field->subkey);
+
+        switch (field->type) {
+            case FW_INT:
+                if (json_isnum(value))
+                    *(size_t*)dst = value->valuedouble;
+                break;
+
+            case FW_STR:
+                *(char**)dst = strdup(json_isstr(value) ? value->valuestring : "");
+                break;
+        }
+    }
+
+    return &(*resultsp)->next;
+}
+
+static void
+free_result(const fw_endpoint *ep, struct list *node)
+{
+    size_t i;
+
+    for (i = 0; i < ep->nfields; ++i)
+        if (ep->fields[i].type == FW_STR)
+            free(*(char**)((char*)node + ep->fields[i].offset));
+
+    free(node);
+}
+
+static void
+decode_results(const fw_endpoint *ep, const cJSON *json, struct list **resultsp)
+{
+    const cJSON *result;
+
+    switch (ep->shape) {
+        case FW_OBJECT:
+            decode_result(ep, json, resultsp);
+            break;
+
+        case FW_LIST:
+            json_foreach (result, json_getobj(json, "results"))
+                resultsp = decode_result(ep, result, resultsp);
+            break;
+
+        case FW_NONE:
+            break;
+    }
+}
+
+static fw_auth*
+auth_acquire(funkctx *ctx)
+{
+    fw_auth *auth;
+
+    pthread_mutex_lock(&ctx->auth.lock);
+    if ((auth = ctx->auth.current))
+        auth->refs++;
+    pthread_mutex_unlock(&ctx->auth.lock);
+
+    return auth;
+}
+
+static void
+auth_release(funkctx *ctx, fw_auth *auth)
+{
+    bool last;
+
+    if (!auth)
+        return;
+
+    pthread_mutex_lock(&ctx->auth.lock);
+    last = !--auth->refs;
+    pthread_mutex_unlock(&ctx->auth.lock);
+
+    if (last) {
+        curl_slist_free_all(auth->headers);
+        free(auth);
+    }
+}
+
+static inline struct curl_slist*
+auth_headers(fw_auth *auth)
+{
+    return auth ? auth->headers : NULL;
+}
+
+static void
+auth_set(funkctx *ctx, const char *token, const char *refresh_token, long expires_in)
+{
+    fw_auth *auth = NULL, *old;
+    char header[TOKEN_SIZE + 32];
+
+    // Don't send an Authorization header if it is not a https connection
+    if (*token && ctx->client->https && (auth = calloc(sizeof(*auth), 1))) {
+        snprintf(header, sizeof(header), "Authorization: Bearer %s", token);
+        auth->headers = curl_slist_append(NULL, header);
+        auth->refs = 1; // The reference of ``ctx->auth.current``
+    }
+
+    pthread_mutex_lock(&ctx->auth.lock);
+
+    old = ctx->auth.current;
+    ctx->auth.current = auth;
+
+    if (refresh_token) {
+        free(ctx->auth.refresh_token);
+        ctx->auth.refresh_token = strdup(refresh_token);
+    }
+    ctx->auth.expires = expires_in > 0 ? time(NULL) + expires_in : 0;
+    ctx->auth.lifetime = expires_in > 0 ? expires_in : 0;
+
+    pthread_cond_signal(&ctx->auth.wake);
+    pthread_mutex_unlock(&ctx->auth.lock);
+
+    // Requests in flight keep the old list alive until they're done
+    auth_release(ctx, old);
+}
+
+static inline long
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// For pthread_cond_timedwait
+static struct timespec
+deadline_after(long ms)
+{
+    struct timespec at;
+
+    clock_gettime(CLOCK_REALTIME, &at);
+    at.tv_sec += ms / 1000;
+    at.tv_nsec += ms % 1000 * 1000000;
+    if (at.tv_nsec >= 1000000000) {
+        at.tv_sec++;
+        at.tv_nsec -= 1000000000;
+    }
+
+    return at;
+}
+
+/*
+ * Hedged GETs.
+ *
+ * Once a GET of fw_get or fw_get_metadata takes longer than 95% of the
+ * previous ones, the same request is sent again on another connection and
+ * the first good answer is taken, the other one is cancelled. It only costs
+ * about 5% more requests and cuts the slow tail. The scheduled transport
+ * drops the loser at once, a plain curl one notices within a second.
+ *
+ * The duplicates are sent by one worker per context, started with the first
+ * hedgeable GET, which only wakes up for the ones outlasting the p95.
+ */
+#define HEDGE_MIN_SAMPLES 16
+#define HEDGE_SAMPLES     64
+
+typedef struct hedge_call {
+    const fw_http_request *req;
+    struct timespec at; // when the duplicate is due
+
+    fw_cancel primary;
+    fw_cancel duplicate;
+    fw_http_response resp; // of the duplicate
+
+    bool primary_done;
+    bool finished; // the worker is done with it
+    bool ok;       // the duplicate got an answer
+} hedge_call;
+
+// Allocated by fw_set_hedging, most sessions never hedge
+typedef struct fw_hedge {
+    long samples[HEDGE_SAMPLES]; // latencies of the last hedgeable GETs
+    size_t nsamples;
+    size_t next;
+
+    fw_transport transport; // for the duplicates, made on first use
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t worker;
+    bool started;
+    bool stop;
+    hedge_call *call; // the GET in flight, if any
+} fw_hedge;
+
+static int
+hedge_cmp(const void *a, const void *b)
+{
+    return *(const long*)a < *(const long*)b ? -1 : *(const long*)a > *(const long*)b;
+}
+
+static long
+hedge_p95(fw_hedge *h)
+{
+    long sorted[HEDGE_SAMPLES];
+
+    memcpy(sorted, h->samples, sizeof(*sorted) * h->nsamples);
+    qsort(sorted, h->nsamples, sizeof(*sorted), hedge_cmp);
+
+    return sorted[h->nsamples * 95 / 100];
+}
+
+static void
+hedge_sample(fw_hedge *h, long latency_ms)
+{
+    h->samples[h->next] = latency_ms;
+    h->next = (h->next + 1) % HEDGE_SAMPLES;
+
+    if (h->nsamples < HEDGE_SAMPLES)
+        h->nsamples++;
+}
+
+static void*
+hedge_worker(void *arg)
+{
+    fw_hedge *h = arg;
+
+    pthread_mutex_lock(&h->lock);
+
+    while (!h->stop) {
+        hedge_call *call = h->call;
+        fw_http_request req;
+        bool ok;
+
+        if (!call || call->finished) {
+            pthread_cond_wait(&h->wake, &h->lock);
+            continue;
+        }
+
+        while (!call->primary_done && !h->stop)
+            if (pthread_cond_timedwait(&h->wake, &h->lock, &call->at) == ETIMEDOUT)
+                break;
+
+        // Most of the time it's not needed at all
+        if (call->primary_done || h->stop) {
+            call->finished = true;
+            pthread_cond_broadcast(&h->wake);
+            continue;
+        }
+
+        req = *call->req;
+        req.cancel = &call->duplicate;
+        req.fresh_connection = true; // The other one may be stalled
+        pthread_mutex_unlock(&h->lock);
+
+        ok = h->transport.send(h->transport.impl, &req, &call->resp) && call->resp.status < 400;
+
+        pthread_mutex_lock(&h->lock);
+
+        if ((call->ok = ok))
+            fw_cancel_trigger(&call->primary);
+
+        call->finished = true;
+        pthread_cond_broadcast(&h->wake);
+    }
+
+    pthread_mutex_unlock(&h->lock);
+
+    return NULL;
+}
+
+static bool
+hedged_send(funkctx *ctx, fw_http_request *req, fw_http_response *resp)
+{
+    fw_hedge *h = ctx->hedge.state;
+    hedge_call call = {.req = req};
+    fw_http_request primary = *req;
+    long start = now_ms();
+    bool hedged = false, ok;
+
+    if (h->nsamples >= HEDGE_MIN_SAMPLES && !h->transport.impl) {
+        h->transport = ctx->transport;
+        h->transport.impl = ctx->transport.dup(ctx->transport.impl);
+    }
+
+    if (h->nsamples >= HEDGE_MIN_SAMPLES && h->transport.impl && !h->started)
+        h->started = !pthread_create(&h->worker, NULL, hedge_worker, h);
+
+    if (h->nsamples >= HEDGE_MIN_SAMPLES && h->started) {
+        call.at = deadline_after(hedge_p95(h));
+        fw_cancel_init(&call.primary, 0, req->cancel);
+        fw_cancel_init(&call.duplicate, 0, req->cancel);
+        primary.cancel = &call.primary;
+
+        pthread_mutex_lock(&h->lock);
+        h->call = &call;
+        pthread_cond_signal(&h->wake);
+        pthread_mutex_unlock(&h->lock);
+
+        hedged = true;
+    }
+
+    ok = ctx->transport.send(ctx->transport.impl, &primary, resp) && resp->status < 400;
+
+    if (hedged) {
+        pthread_mutex_lock(&h->lock);
+
+        // A failed primary still waits for the duplicate
+        call.primary_done = true;
+        if (ok)
+            fw_cancel_trigger(&call.duplicate);
+
+        pthread_cond_broadcast(&h->wake);
+
+        while (!call.finished)
+            pthread_cond_wait(&h->wake, &h->lock);
+
+        h->call = NULL;
+        pthread_mutex_unlock(&h->lock);
+
+        if (!ok && call.ok) {
+            fw_response_free(resp);
+            *resp = call.resp;
+            ok = true;
+        }
+        else {
+            fw_response_free(&call.resp);
+        }
+    }
+
+    if (ok)
+        hedge_sample(h, now_ms() - start);
+
+    return ok || resp->status;
+}
+
+static fw_hedge*
+hedge_new(void)
+{
+    fw_hedge *h = calloc(sizeof(*h), 1); // Don't forget to free
+
+    if (!h)
+        return NULL;
+
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->wake, NULL);
+
+    return h;
+}
+
+static void
+hedge_free(fw_hedge *h)
+{
+    if (!h)
+        return;
+
+    if (h->started) {
+        pthread_mutex_lock(&h->lock);
+        h->stop = true;
+        pthread_cond_signal(&h->wake);
+        pthread_mutex_unlock(&h->lock);
+
+        pthread_join(h->worker, NULL);
+    }
+
+    if (h->transport.impl)
+        h->transport.free(h->transport.impl);
+
+    pthread_cond_destroy(&h->wake);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+// The context token is the user's, set around their own calls. The copies of
+// the background threads only go by theirs, which they cancel on stop.
+static inline const fw_cancel*
+request_cancel(funkctx *ctx, const fw_transport *transport)
+{
+    return transport == &ctx->transport ? ctx->cancel : transport->cancel;
+}
+
+// Sends a request with the Authorization header of the context. The
+// ``content_type`` header, if any, is put in front of it. ``transport`` is
+// either the context one or a copy owned by a background thread.
+static bool
+perform_on(funkctx *ctx, fw_transport *transport, fw_http_request *req, const char *content_type, fw_http_response *resp)
+{
+    bool ok;
+    fw_auth *auth = auth_acquire(ctx); // Don't forget to release
+    struct curl_slist headers = {(char*)content_type, auth_headers(auth)};
+
+    req->headers = content_type ? &headers : auth_headers(auth);
+
+    if (!req->timeout_ms)
+        req->timeout_ms = ctx->timeout_ms;
+
+    if (!req->cancel)
+        req->cancel = request_cancel(ctx, transport);
+
+    if (req->priority < transport->priority)
+        req->priority = transport->priority;
+
+    if (fw_cancelled(req->cancel)) {
+        snprintf(resp->error, sizeof(resp->error), "%s", fw_cancel_reason(req->cancel));
+        ok = false;
+    }
+    else if (ctx->hedge.enabled && ctx->hedge.armed && transport == &ctx->transport && !strcmp(req->method, "GET")) {
+        ok = hedged_send(ctx, req, resp);
+    }
+    else {
+        ok = transport->send(transport->impl, req, resp);
+    }
+
+    auth_release(ctx, auth);
+
+    if (ok && resp->status >= 400)
+        snprintf(resp->error, sizeof(resp->error), "%s %s: HTTP %ld", req->method, req->target, resp->status);
+
+    return ok && resp->status < 400;
+}
+
+// A copy of the context transport for another thread, freed with its ``free``
+bool
+fw_copy_transport(funkctx *ctx, fw_transport *copy)
+{
+    *copy = ctx->transport;
+
+    return (copy->impl = ctx->transport.dup(ctx->transport.impl)) != NULL;
+}
+
+// Sends a request made elsewhere (see the daemon) with the context
+// authorization, unless ``headers`` has its own. ``headers`` is only borrowed
+// and the status is left to the caller.
+bool
+fw_forward(funkctx *ctx, fw_transport *transport, fw_http_request *req, struct curl_slist *headers, fw_http_response *resp)
+{
+    fw_auth *auth = auth_acquire(ctx); // Don't forget to release
+    struct curl_slist *header, *tail = NULL;
+    bool authorized = false, ok;
+
+    for (header = headers; header; header = header->next) {
+        authorized |= !strncasecmp(header->data, "Authorization:", 14);
+        tail = header;
+    }
+
+    req->headers = headers;
+
+    if (!authorized && tail)
+        tail->next = auth_headers(auth);
+    else if (!authorized)
+        req->headers = auth_headers(auth);
+
+    if (!req->timeout_ms)
+        req->timeout_ms = ctx->timeout_ms;
+
+    if (!req->cancel)
+        req->cancel = request_cancel(ctx, transport);
+
+    if (req->priority < transport->priority)
+        req->priority = transport->priority;
+
+    ok = transport->send(transport->impl, req, resp);
+
+    if (tail)
+        tail->next = NULL;
+
+    auth_release(ctx, auth);
+
+    return ok;
+}
+
+static bool
+perform(funkctx *ctx, fw_http_request *req, const char *content_type, fw_http_response *resp)
+{
+    bool ok = perform_on(ctx, &ctx->transport, req, content_type, resp);
+
+    if (!ok)
+        snprintf(ctx->error, sizeof(ctx->error), "%s", resp->error);
+
+    return ok;
+}
+
+
+static fw_client*
+client_new(const char *scheme, const char *server)
+{
+    fw_client *client = calloc(sizeof(*client), 1); // Don't forget to unref
+
+    if (!client)
+        return NULL;
+
+    pthread_mutex_init(&client->lock, NULL);
+    client->refs = 1;
+    client->https = !strcasecmp(scheme, "https");
+    snprintf(client->url, sizeof(client->url), "%s://%s", scheme, server);
+
+    return client;
+}
+
+static void
+client_unref(fw_client *client)
+{
+    fw_app *app, *prev;
+    bool last;
+
+    pthread_mutex_lock(&client->lock);
+    last = !--client->refs;
+    pthread_mutex_unlock(&client->lock);
+
+    if (!last)
+        return;
+
+    for (app = client->app; app; app = prev) {
+        prev = app->prev;
+        free(app);
+    }
+
+    if (client->transport.impl)
+        client->transport.free(client->transport.impl);
+
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+// The app stays valid as long as the client, a newer one only hides it
+static const fw_app*
+client_app(fw_client *client)
+{
+    const fw_app *app;
+
+    pthread_mutex_lock(&client->lock);
+    app = client->app;
+    pthread_mutex_unlock(&client->lock);
+
+    return app;
+}
+
+static void
+client_set_app(fw_client *client, fw_app *app)
+{
+    snprintf(app->auth_url, sizeof(app->auth_url),
+             "%s/authorize?response_type=code&redirect_uri=%s&clint_id=%s&scope=%s",
+             client->url,
+             url_encode_n(app->redirect_uri, (char[3*sizeof(app->redirect_uri)]){'\0'}, 3*sizeof(app->redirect_uri)),
+             url_encode_n(app->client_id,    (char[3*sizeof(app->client_id)]){'\0'},    3*sizeof(app->client_id)),
+             url_encode_n(app->scope,        (char[3*sizeof(app->scope)]){'\0'},        3*sizeof(app->scope)));
+
+    pthread_mutex_lock(&client->lock);
+    app->prev = client->app;
+    client->app = app;
+    pthread_mutex_unlock(&client->lock);
+}
+
+// Takes over ``transport``
+static funkctx*
+session_new(fw_client *client, fw_transport transport)
+{
+    funkctx *ctx = calloc(sizeof(funkctx), 1); // Don't forget to free
+
+    if (!ctx)
+        return NULL;
+
+    pthread_mutex_lock(&client->lock);
+    client->refs++;
+    pthread_mutex_unlock(&client->lock);
+
+    ctx->client = client;
+    ctx->transport = transport;
+
+    pthread_mutex_init(&ctx->auth.lock, NULL);
+    pthread_cond_init(&ctx->auth.wake, NULL);
+
+    return ctx;
+}
+
+funkctx*
+fw_init_transport(const char *scheme, const char *server, fw_transport transport)
+{
+    fw_client *client = client_new(scheme, server);
+    funkctx *ctx;
+
+    if (!client)
+        return NULL;
+
+    // The context holds the only reference
+    ctx = session_new(client, transport);
+    client_unref(client);
+
+    return ctx;
+}
+
+// TLS sessions, HSTS and Alt-Svc are kept in ``cache_path`` across runs
+funkctx*
+fw_init_cached(char *scheme, const char *server, const char *cache_path)
+{
+    fw_transport transport;
+    funkctx *ctx;
+
+    if (!fw_curl_transport_cached(&transport, scheme, server, cache_path))
+        return NULL;
+
+    if (!(ctx = fw_init_transport(scheme, server, transport)))
+        transport.free(transport.impl);
+
+    return ctx;
+}
+
+// Everything goes through the daemon listening on ``socket_path``
+funkctx*
+fw_init_daemon(const char *scheme, const char *server, const char *socket_path)
+{
+    fw_transport transport;
+    funkctx *ctx;
+
+    if (!fw_daemon_transport(&transport, socket_path))
+        return NULL;
+
+    if (!(ctx = fw_init_transport(scheme, server, transport)))
+        transport.free(transport.impl);
+
+    return ctx;
+}
+
+funkctx*
+fw_init(char *scheme, const char *server)
+{
+    return fw_init_cached(scheme, server, NULL);
+}
+
+/*
+ * Shared client.
+ *
+ * A client holds the connections, their caches, the server and the app
+ * registration. Its sessions are contexts like the ones of fw_init, but only
+ * carry the credentials and the results of one user, they take a few hundred
+ * bytes and send through copies of the client transport. With the scheduled
+ * one of fw_client_new, all of them share its handful of connections.
+ *
+ * Registering an app (fw_get_app_token, fw_set_app_token) from any session
+ * does it for the whole client.
+ */
+fw_client*
+fw_client_transport(const char *scheme, const char *server, fw_transport transport)
+{
+    fw_client *client = client_new(scheme, server); // Don't forget to free
+
+    if (client)
+        client->transport = transport;
+
+    return client;
+}
+
+fw_client*
+fw_client_new(const char *scheme, const char *server, const fw_sched_opts *opts)
+{
+    fw_transport transport;
+    fw_client *client;
+
+    if (!fw_sched_transport(&transport, scheme, server, opts))
+        return NULL;
+
+    if (!(client = fw_client_transport(scheme, server, transport)))
+        transport.free(transport.impl);
+
+    return client;
+}
+
+// Don't forget to fw_free, the sessions keep the client alive
+funkctx*
+fw_session(fw_client *client)
+{
+    fw_transport transport = client->transport;
+    funkctx *ctx;
+
+    if (!(transport.impl = transport.dup(client->transport.impl)))
+        return NULL;
+
+    if (!(ctx = session_new(client, transport)))
+        transport.free(transport.impl);
+
+    return ctx;
+}
+
+// Whatever sessions are left keep working
+void
+fw_client_free(fw_client *client)
+{
+    if (client)
+        client_unref(client);
+}
+
+// Handshake of the connection made at init and what the cache saved on it
+bool
+fw_connection_stats(funkctx *ctx, long *handshake_us, long *saved_us)
+{
+    return fw_transport_stats(&ctx->transport, handshake_us, saved_us);
+}
+
+bool
+print_results(funkctx *ctx)
+{
+    struct list *node;
+
+    for (node = ctx->results; node; node = node->next) {
+        switch (ctx->result_type) {
+            case FW_NOTHING:
+                printf("There are no results\n");
+                break;
+
+            case FW_ARTISTS:
+                printf("%zu. %s\n", node->artist.id, node->artist.name);
+                break;
+
+            case FW_ALBUMS:
+                printf("%zu. %s\n", node->album.id, node->album.name);
+                break;
+
+            case FW_TRACKS:
+                printf("%zu. %s\n", node->track.id, node->track.name);
+                break;
+
+            case FW_LIBRARIES:
+                printf("%s (%s)\n", node->library.name, node->library.id);
+                printf("    %s\n", node->library.desc);
+                break;
+
+            case FW_CHANNELS:
+                printf("%s (@%s/%s)\n", node->channel.name, node->channel.username, node->channel.id);
+                break;
+
+            case FW_METADATA:
+                switch (ctx->metadata_type) {
+                    case FW_META_LANGUAGE:
+                        printf("%s\n", node->language.label);
+                        break;
+                    case FW_META_CATEGORY: {
+                        fw_subcategory *sub;
+
+                        printf("%s\n", node->category.label);
+
+                        for (sub = node->category.sub; sub; sub = sub->next)
+                            printf("    %s\n", sub->label);
+
+                        break;
+                    }
+
+                    case FW_META_NOTHING:
+                    default:
+                        break;
+                }
+                break;
+
+            case FW_ATTACHMENTS:
+                printf("%s (%s)\n", ctx->results->attachment.mime, ctx->results->attachment.id);
+                break;
+
+            default: {
+                const fw_endpoint *ep = endpoint(ctx->result_type);
+                size_t i;
+
+                for (i = 0; ep && i < ep->nfields; ++i) {
+                    const char *field = (char*)node + ep->fields[i].offset;
+
+                    if (ep->fields[i].type == FW_INT)
+                        printf("%s%zu", i ? " " : "", *(size_t*)field);
+                    else
+                        printf("%s%s", i ? " " : "", *(char**)field);
+                }
+
+                printf("\n");
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+// The results of the last request, valid until the next one
+const struct list*
+fw_results(funkctx *ctx, fw_request_type *type)
+{
+    if (type)
+        *type = ctx->result_type;
+
+    return ctx->results;
+}
+
+// The results as a JSON array of objects keyed by the member names. Don't
+// forget to free
+char*
+fw_results_json(funkctx *ctx)
+{
+    const fw_endpoint *ep = endpoint(ctx->result_type);
+    cJSON *array = json_create_array();
+    struct list *node;
+    char *str;
+
+    for (node = ctx->results; node; node = node->next) {
+        cJSON *obj = json_create_object();
+        size_t i;
+
+        if (ctx->result_type == FW_METADATA && ctx->metadata_type == FW_META_LANGUAGE) {
+            json_add_to_object(obj, "value", json_create_string(node->language.value));
+            json_add_to_object(obj, "label", json_create_string(node->language.label));
+        }
+        else if (ctx->result_type == FW_METADATA && ctx->metadata_type == FW_META_CATEGORY) {
+            cJSON *subs = json_create_array();
+            fw_subcategory *sub;
+
+            for (sub = node->category.sub; sub; sub = sub->next)
+                json_add_to_array(subs, json_create_string(sub->label));
+
+            json_add_to_object(obj, "value", json_create_string(node->category.value));
+            json_add_to_object(obj, "label", json_create_string(node->category.label));
+            json_add_to_object(obj, "sub", subs);
+        }
+
+        for (i = 0; ep && i < ep->nfields; ++i) {
+            const fw_field *field = &ep->fields[i];
+            const char *name = strchr(field->member, '.') + 1;
+            const char *src = (char*)node + field->offset;
+
+            if (field->type == FW_INT)
+                json_add_to_object(obj, name, json_create_number(*(size_t*)src));
+            else
+                json_add_to_object(obj, name, json_create_string(*(char**)src));
+        }
+
+        json_add_to_array(array, obj);
+    }
+
+    str = json_print_raw(array);
+    json_delete(array);
+
+    return str;
+}
+
+const char*
+fw_error_str(funkctx *ctx)
+{
+    return ctx->error;
+}
+
+// Every request gives up after ``timeout_ms``, 0 means never
+void
+fw_set_timeout(funkctx *ctx, long timeout_ms)
+{
+    ctx->timeout_ms = timeout_ms;
+}
+
+// The requests of the context are cancelled along with ``cancel`` (or when
+// its deadline is over) until it's set again, NULL for none. The background
+// threads made from the context don't go by it.
+void
+fw_set_cancel(funkctx *ctx, const fw_cancel *cancel)
+{
+    ctx->cancel = cancel;
+}
+
+// Lets fw_get and fw_get_metadata send slow requests twice
+void
+fw_set_hedging(funkctx *ctx, bool enabled)
+{
+    // Most sessions never hedge, they don't carry the samples
+    if (enabled && !ctx->hedge.state)
+        ctx->hedge.state = hedge_new();
+
+    ctx->hedge.enabled = enabled && ctx->hedge.state;
+}
+
+bool
+clean_results(funkctx *ctx)
+{
+    struct list *node, *next;
+    const fw_endpoint *ep = endpoint(ctx->result_type);
+
+    for (node = ctx->results; node; node = next) {
+        next = node->next;
+
+        if (ctx->result_type == FW_NOTHING) {
+            fprintf(stderr, "Impossible case. Check the code for memory leaking.\n");
+            return true;
+        }
+        else if (ctx->result_type == FW_METADATA) {
+            switch (ctx->metadata_type) {
+                case FW_META_LANGUAGE:
+                    free(node->language.value);
+                    free(node->language.label);
+                    break;
+                case FW_META_CATEGORY: {
+                    fw_subcategory *sub, *sub_next;
+
+                    free(node->category.value);
+                    free(node->category.label);
+
+                    for (sub = node->category.sub; sub; sub = sub_next) {
+                        sub_next = sub->next;
+
+                        free(sub->label);
+                        free(sub);
+                    }
+
+                    break;
+                }
+
+                case FW_META_NOTHING:
+                default:
+                    break;
+            }
+        }
+        else if (ep) {
+            free_result(ep, node);
+            continue;
+        }
+
+        free(node);
+    }
+
+    ctx->result_type = FW_NOTHING;
+    ctx->results = NULL;
+
+    return true;
+}
+
+bool
+fw_get_metadata(funkctx *ctx, fw_metadata_type type)
+{
+    fw_http_request req = {"GET", "/api/v1/channels/metadata-choices"};
+    fw_http_response resp = {0};
+    cJSON *json, *result, *results;
+    struct list **resultsp = &ctx->results;
+    bool ok;
+
+    clean_results(ctx);
+    ctx->result_type = FW_METADATA;
+    ctx->metadata_type = type;
+
+    ctx->hedge.armed = true;
+    ok = perform(ctx, &req, NULL, &resp);
+    ctx->hedge.armed = false;
+
+    if (!ok) {
+        fw_response_free(&resp);
+        return false;
+    }
+
+    // TODO: check the json object before parsing
+    json = json_parse_len(resp.body.data, resp.body.size); // json tree is allocated. Don't forget to free
+    fw_response_free(&resp);
+
+    switch (type) {
+        case FW_META_LANGUAGE:
+            results = json_getobj(json, "language");
+            break;
+
+        case FW_META_CATEGORY:
+            results = json_getobj(json, "itunes_category");
+            break;
+
+        case FW_META_NOTHING:
+        default:
+            json_delete(json);
+            return false;
+    }
+
+    json_foreach (result, results) {
+        char *value = json_getobj(result, "value")->valuestring;
+        char *label = json_getobj(result, "label")->valuestring;
+
+        if (ctx->metadata_type == FW_META_LANGUAGE) {
+            *resultsp = calloc(sizeof(**resultsp), 1);
+
+            (*resultsp)->language.value = malloc(strlen(value) + 1);
+            (*resultsp)->language.label = malloc(strlen(label) + 1);
+
+            strcpy((*resultsp)->language.value, value);
+            strcpy((*resultsp)->language.label, label);
+        }
+        else if (ctx->metadata_type == FW_META_CATEGORY) {
+            cJSON *sub;
+            fw_subcategory **sub_next;
+
+            *resultsp = calloc(sizeof(**resultsp), 1);
+
+            (*resultsp)->category.value = malloc(strlen(value) + 1);
+            (*resultsp)->category.label = malloc(strlen(label) + 1);
+
+            strcpy((*resultsp)->category.value, value);
+            strcpy((*resultsp)->category.label, label);
+
+            sub_next = &(*resultsp)->category.sub;
+
+            json_foreach (sub, json_getobj(result, "children")) {
+                *sub_next = calloc(sizeof(**sub_next), 1);
+                (*sub_next)->label = malloc(strlen(sub->valuestring) + 1);
+                strcpy((*sub_next)->label, sub->valuestring);
+                sub_next = &(*sub_next)->next;
+            }
+        }
+
+        resultsp = &(*resultsp)->next;
+    }
+
+    json_delete(json);
+
+    return true;
+}
+
+/*
+ * Generic request engine driven by the ``endpoints`` table.
+ *
+ * ``id`` fills the path template, ``query`` is an already encoded query added
+ * to the default one and ``body`` is sent as JSON. ``cancel`` replaces the
+ * token of the transport for this call only. The response is left in
+ * ``resp``, so it must be freed whatever is returned.
+ */
+static bool
+send_request_with(funkctx *ctx, fw_transport *transport, const fw_endpoint *ep, const char *id,
+                  const char *query, const cJSON *body, const fw_cancel *cancel, fw_http_response *resp)
+{
+    fw_http_request req = {0};
+    char *post_str = NULL;
+    char request[4*1024];
+    const char *target;
+    bool ok;
+
+    if (!ep || (!ep->target && !id))
+        return false;
+
+    if (ep->target && !query) {
+        target = ep->target; // Pre-rendered, nothing to do
+    }
+    else {
+        char id_enc[3*256] = "";
+        size_t len = sizeof(request); // An id too long is a target too long
+
+        if (!id || url_encode_n(id, id_enc, sizeof(id_enc)))
+            len = snprintf(request, sizeof(request), ep->path, id_enc);
+
+        if (*ep->query && len < sizeof(request))
+            len += snprintf(request + len, sizeof(request) - len, "?%s", ep->query);
+
+        if (query && *query && len < sizeof(request))
+            len += snprintf(request + len, sizeof(request) - len, "%c%s", *ep->query ? '&' : '?', query);
+
+        if (len >= sizeof(request)) {
+            snprintf(resp->error, sizeof(resp->error), "The request target is too long");
+            if (transport == &ctx->transport)
+                snprintf(ctx->error, sizeof(ctx->error), "%s", resp->error);
+            return false;
+        }
+
+        target = request;
+    }
+
+    if (body)
+        post_str = json_print_raw(body); // Don't forget to free
+
+    req.method = ep->method;
+    req.target = target;
+    req.body = post_str;
+    req.body_size = post_str ? strlen(post_str) : 0;
+    req.cancel = cancel;
+
+    ok = perform_on(ctx, transport, &req, body ? "Content-Type: application/json" : NULL, resp);
+    free(post_str);
+
+    if (!ok && transport == &ctx->transport)
+        snprintf(ctx->error, sizeof(ctx->error), "%s", resp->error);
+
+    return ok;
+}
+
+static inline bool
+send_request_on(funkctx *ctx, fw_transport *transport, const fw_endpoint *ep,
+                const char *id, const char *query, const cJSON *body, fw_http_response *resp)
+{
+    return send_request_with(ctx, transport, ep, id, query, body, NULL, resp);
+}
+
+static inline bool
+send_request(funkctx *ctx, const fw_endpoint *ep, const char *id, const char *query, const cJSON *body, fw_http_response *resp)
+{
+    return send_request_with(ctx, &ctx->transport, ep, id, query, body, NULL, resp);
+}
+
+static bool
+request_with(funkctx *ctx, fw_request_type req_type, const char *id, const char *query,
+             const cJSON *body, const fw_cancel *cancel)
+{
+    fw_http_response resp = {0};
+    const fw_endpoint *ep = endpoint(req_type);
+    cJSON *json;
+    bool ok;
+
+    clean_results(ctx);
+
+    if (!ep)
+        return false;
+
+    ctx->result_type = req_type;
+    ok = send_request_with(ctx, &ctx->transport, ep, id, query, body, cancel, &resp);
+
+    if (!ok || !resp.body.size || ep->shape == FW_NONE) {
+        fw_response_free(&resp);
+        return ok;
+    }
+
+    json = json_parse_len(resp.body.data, resp.body.size); // json tree is allocated. Don't forget to free
+    fw_response_free(&resp);
+
+    decode_results(ep, json, &ctx->results);
+    json_delete(json);
+
+    return true;
+}
+
+// Results are decoded into ``ctx->results`` according to the endpoint fields
+bool
+fw_request(funkctx *ctx, fw_request_type req_type, const char *id, const char *query, const cJSON *body)
+{
+    return request_with(ctx, req_type, id, query, body, NULL);
+}
+
+static bool
+get_with(funkctx *ctx, fw_request_type req_type, const char *search, const fw_cancel *cancel)
+{
+    char query[3*1024] = "q=";
+
+    bool ok;
+
+    // Add a 'q' request if it's needed
+    if (search && *search != '\0' && !url_encode_n(search, query + 2, sizeof(query) - 2)) {
+        clean_results(ctx);
+        snprintf(ctx->error, sizeof(ctx->error), "The search is too long");
+        return false;
+    }
+
+    // Nothing but reads, they can be sent twice
+    ctx->hedge.armed = true;
+    ok = request_with(ctx, req_type, NULL, search && *search != '\0' ? query : NULL, NULL, cancel);
+    ctx->hedge.armed = false;
+
+    return ok;
+}
+
+bool
+fw_get(funkctx *ctx, fw_request_type req_type, const char *search)
+{
+    return get_with(ctx, req_type, search, NULL);
+}
+
+static inline const char*
+id_str(char *buf, size_t id)
+{
+    sprintf(buf, "%zu", id);
+
+    return buf;
+}
+
+static bool
+favorites_mark(funkctx *ctx, size_t track_id, bool favorite)
+{
+    size_t word = track_id / 64;
+
+    if (word >= ctx->favorites.nwords) {
+        size_t nwords = ctx->favorites.nwords ? ctx->favorites.nwords : 64;
+        uint64_t *bits;
+
+        if (!favorite)
+            return true;
+
+        while (nwords <= word)
+            nwords *= 2;
+
+        if (!(bits = realloc(ctx->favorites.bits, sizeof(*bits) * nwords)))
+            return false;
+
+        memset(bits + ctx->favorites.nwords, 0, sizeof(*bits) * (nwords - ctx->favorites.nwords));
+        ctx->favorites.bits = bits;
+        ctx->favorites.nwords = nwords;
+    }
+
+    if (favorite)
+        ctx->favorites.bits[word] |= (uint64_t)1 << track_id % 64;
+    else
+        ctx->favorites.bits[word] &= ~((uint64_t)1 << track_id % 64);
+
+    return true;
+}
+
+// Loads every favorite of the user at once, fw_set_favorite keeps it up to date
+// afterwards. The results are left alone.
+bool
+fw_load_favorites(funkctx *ctx)
+{
+    fw_http_response resp = {0};
+    cJSON *json, *favorite;
+    bool ok;
+
+    if (!send_request(ctx, endpoint(FW_FAVORITES_ALL), NULL, NULL, NULL, &resp)) {
+        fw_response_free(&resp);
+        return false;
+    }
+
+    json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+    fw_response_free(&resp);
+
+    if (!(ok = json_isobj(json)))
+        snprintf(ctx->error, sizeof(ctx->error), "Couldn't read the favorites");
+
+    free(ctx->favorites.bits);
+    ctx->favorites.bits = NULL;
+    ctx->favorites.nwords = 0;
+
+    json_foreach (favorite, json_getobj(json, "results")) {
+        const cJSON *track = json_getobj(favorite, "track");
+
+        if (ok && json_isnum(track) && track->valuedouble >= 0)
+            ok = favorites_mark(ctx, track->valuedouble, true);
+    }
+
+    json_delete(json);
+    ctx->favorites.loaded = ok;
+
+    return ok;
+}
+
+// False as well if the favorites are not loaded
+bool
+fw_is_favorite(funkctx *ctx, size_t track_id)
+{
+    size_t word = track_id / 64;
+
+    return word < ctx->favorites.nwords && ctx->favorites.bits[word] >> track_id % 64 & 1;
+}
+
+// Fills ``favorite`` for every track and returns how many of them are
+size_t
+fw_check_favorites(funkctx *ctx, const fw_track *tracks, size_t count, bool *favorite)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < count; ++i)
+        n += favorite[i] = fw_is_favorite(ctx, tracks[i].id);
+
+    return n;
+}
+
+bool
+fw_set_favorite(funkctx *ctx, size_t track_id, bool favorite)
+{
+    bool ok;
+    cJSON *body = json_create_object(); // Don't forget to free
+
+    json_add_to_object(body, "track", json_create_number(track_id));
+    ok = fw_request(ctx, favorite ? FW_FAVORITE_ADD : FW_FAVORITE_REMOVE, NULL, NULL, body);
+    json_delete(body);
+
+    // A failed update would leave the index out of date, so it's dropped
+    if (ok && ctx->favorites.loaded && !favorites_mark(ctx, track_id, favorite)) {
+        free(ctx->favorites.bits);
+        ctx->favorites.bits = NULL;
+        ctx->favorites.nwords = 0;
+        ctx->favorites.loaded = false;
+    }
+
+    return ok;
+}
+
+bool
+fw_playlist_add(funkctx *ctx, size_t playlist_id, const size_t *track_ids, size_t count, bool allow_duplicates)
+{
+    bool ok;
+    size_t i;
+    cJSON *tracks, *body = json_create_object(); // Don't forget to free
+
+    json_add_to_object(body, "tracks", tracks = json_create_array());
+    json_add_to_object(body, "allow_duplicates", json_create_bool(allow_duplicates));
+
+    for (i = 0; i < count; ++i)
+        json_add_to_array(tracks, json_create_number(track_ids[i]));
+
+    ok = fw_request(ctx, FW_PLAYLIST_ADD, id_str((char[32]){'\0'}, playlist_id), NULL, body);
+    json_delete(body);
+
+    return ok;
+}
+
+bool
+fw_playlist_move(funkctx *ctx, size_t playlist_id, size_t from, size_t to)
+{
+    bool ok;
+    cJSON *body = json_create_object(); // Don't forget to free
+
+    json_add_to_object(body, "from", json_create_number(from));
+    json_add_to_object(body, "to", json_create_number(to));
+    ok = fw_request(ctx, FW_PLAYLIST_MOVE, id_str((char[32]){'\0'}, playlist_id), NULL, body);
+    json_delete(body);
+
+    return ok;
+}
+
+bool
+fw_playlist_remove(funkctx *ctx, size_t playlist_id, size_t index)
+{
+    bool ok;
+    cJSON *body = json_create_object(); // Don't forget to free
+
+    json_add_to_object(body, "index", json_create_number(index));
+    ok = fw_request(ctx, FW_PLAYLIST_REMOVE, id_str((char[32]){'\0'}, playlist_id), NULL, body);
+    json_delete(body);
+
+    return ok;
+}
+
+// Everything of the upload form up to the audio data, which is ``audio_size`` long
+static void
+upload_form_head(FILE *post_file, const char *boundary, const char *lib_id, const fw_track_tags *tags, size_t audio_size)
+{
+    cJSON *metadata = json_create_object(); // Don't forget to free
+    char *metadata_str;
+
+    json_add_to_object(metadata, "title", json_create_string(tags->title));
+    json_add_to_object(metadata, "position", json_create_number(atoi(tags->track)));
+    metadata_str = json_print_raw(metadata); // Don't forget to free
+    json_delete(metadata);
+
+    fprintf(post_file, "--%s\r\n", boundary);
+    fprintf(post_file, "Content-Disposition: form-data; name=\"library\"\r\n\r\n");
+    fprintf(post_file, "%s\r\n", lib_id);
+    fprintf(post_file, "--%s\r\n", boundary);
+    fprintf(post_file, "Content-Disposition: form-data; name=\"import_reference\"\r\n\r\n");
+    fprintf(post_file, "Import launched via libfunkwhale\r\n");
+    fprintf(post_file, "--%s\r\n", boundary);
+    fprintf(post_file, "Content-Disposition: form-data; name=\"source\"\r\n\r\n");
+    fprintf(post_file, "upload://filename.mp3\r\n");
+    fprintf(post_file, "--%s\r\n", boundary);
+    fprintf(post_file, "Content-Disposition: form-data; name=\"import_status\"\r\n\r\n");
+    fprintf(post_file, "pending\r\n");
+    fprintf(post_file, "--%s\r\n", boundary);
+    fprintf(post_file, "Content-Disposition: form-data; name=\"import_metadata\"\r\n\r\n");
+    fprintf(post_file, "%s\r\n", metadata_str);
+    fprintf(post_file, "--%s\r\n", boundary);
+    fprintf(post_file, "Content-Disposition: form-data; name=\"audio_file\"; filename=\"filename.mp3\"\"\r\n");
+    fprintf(post_file, "Content-Type: audio/mpeg\r\n");
+    fprintf(post_file, "Content-Length: %zu\r\n", audio_size);
+    fprintf(post_file, "\r\n");
+
+    free(metadata_str);
+}
+
+// Sends the upload form and closes ``post_file``. The created upload is put
+// at ``resultsp``
+static bool
+upload_send(funkctx *ctx, FILE *post_file, const char *boundary, struct list **resultsp)
+{
+    bool ok;
+    fw_http_request req = {"POST", "/api/v1/uploads", .priority = FW_PRIO_BULK};
+    fw_http_response resp = {0};
+    char content_type[128];
+
+    fprintf(post_file, "\r\n");
+    fprintf(post_file, "--%s--\r\n\r\n", boundary);
+
+    snprintf(content_type, sizeof(content_type), "Content-Type: multipart/form-data; boundary=%s", boundary);
+
+    // The body is streamed from the file instead of being mapped
+    req.body_size = fsize(post_file);
+    req.body_file = post_file;
+    rewind(post_file);
+
+    ok = perform(ctx, &req, content_type, &resp);
+    fclose(post_file);
+
+    if (ok) {
+        cJSON *json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+
+        decode_result(endpoint(FW_UPLOAD), json, resultsp);
+        json_delete(json);
+    }
+
+    fw_response_free(&resp);
+
+    return ok;
+}
+
+bool
+fw_upload_track(funkctx *ctx, const char *lib_id, fw_track_tags *tags)
+{
+    FILE *post_file;
+
+    size_t mp3_size;
+    const uint8_t *mp3;
+
+    char boundary[16];
+
+    ID3v2_tag *tag;
+
+    const char *unreadable = NULL;
+
+    clean_results(ctx);
+
+    // errno is the one of the failed check
+    if (access(tags->track_file, R_OK))
+        unreadable = tags->track_file;
+    else if (*tags->cover_file && access(tags->cover_file, R_OK))
+        unreadable = tags->cover_file;
+
+    if (unreadable) {
+        snprintf(ctx->error, sizeof(ctx->error), "%s: %s", unreadable, strerror(errno));
+        return false;
+    }
+
+    if (!(post_file = tmpfile())) { // Don't forget to close
+        snprintf(ctx->error, sizeof(ctx->error), "tmpfile: %s", strerror(errno));
+        return false;
+    }
+
+    tag = new_tag(); // Dont forget to free
+
+    tag_set_artist(tags->artist, 3, tag);
+    tag_set_album(tags->album, 3, tag);
+    tag_set_title(tags->title, 3, tag);
+    tag_set_genre(tags->genre, 3, tag);
+    tag_set_track(tags->track, 3, tag);
+    tag_set_year(tags->year, 3, tag);
+    if (*tags->cover_file)
+        tag_set_album_cover(tags->cover_file, tag);
+
+    {   // Making mp3id3v2 taged pointer. Don't forget to unmap ``mp3``
+        char mp3id_name[] = "/tmp/XXXXXX";
+        FILE *mp3id_file = fdopen(mkstemp(mp3id_name), "r+");
+
+        if (!file_copy(mp3id_name, tags->track_file)) {
+            snprintf(ctx->error, sizeof(ctx->error), "%s: %s", tags->track_file, strerror(errno));
+            free_tag(tag);
+            unlink(mp3id_name);
+            fclose(mp3id_file);
+            fclose(post_file);
+            return false;
+        }
+
+        set_tag(mp3id_name, tag);
+        free_tag(tag);
+        unlink(mp3id_name);
+
+        mp3_size = fsize(mp3id_file);
+        mp3 = mmap(NULL, mp3_size, PROT_READ, MAP_PRIVATE, fileno(mp3id_file), 0);
+        fclose(mp3id_file);
+    }
+
+    gen_str(boundary, sizeof(boundary) - 1);
+
+    upload_form_head(post_file, boundary, lib_id, tags, mp3_size);
+    fwrite(mp3, mp3_size, 1, post_file);
+
+    munmap((void*)mp3, mp3_size);
+
+    ctx->result_type = FW_UPLOAD;
+
+    return upload_send(ctx, post_file, boundary, &ctx->results);
+}
+
+/*
+ * Album uploads.
+ *
+ * The frames the tracks of an album share (artist, album, genre, year and the
+ * cover) are encoded once into a template. A track gets an ID3v2.4 tag made
+ * of the template and its own title and track number frames, followed by the
+ * audio of its file without the tag it had, so neither the cover nor the
+ * audio goes through id3v2lib and a temporary copy for every track.
+ */
+struct fw_album_template {
+    fw_buf frames;
+};
+
+static void
+id3_syncsafe(uint8_t *out, size_t size)
+{
+    out[0] = size >> 21 & 0x7f;
+    out[1] = size >> 14 & 0x7f;
+    out[2] = size >> 7 & 0x7f;
+    out[3] = size & 0x7f;
+}
+
+static bool
+id3_frame(fw_buf *buf, const char *id, const void *head, size_t head_size, const void *data, size_t size)
+{
+    uint8_t header[10] = {0};
+
+    memcpy(header, id, 4);
+    id3_syncsafe(header + 4, head_size + size);
+
+    return buf_append(buf, header, sizeof(header))
+        && buf_append(buf, head, head_size)
+        && buf_append(buf, data, size);
+}
+
+// UTF-8 text frame, nothing if the text is empty
+static bool
+id3_text(fw_buf *buf, const char *id, const char *text)
+{
+    return !*text || id3_frame(buf, id, "\x03", 1, text, strlen(text));
+}
+
+// Size of the ID3v2 tag the audio starts with, 0 if there is none
+static size_t
+id3_skip(const uint8_t *data, size_t size)
+{
+    size_t tag;
+
+    if (size < 10 || memcmp(data, "ID3", 3))
+        return 0;
+
+    tag = 10 + ((size_t)(data[6] & 0x7f) << 21 | (data[7] & 0x7f) << 14 | (data[8] & 0x7f) << 7 | (data[9] & 0x7f));
+
+    if (data[5] & 0x10) // footer
+        tag += 10;
+
+    return tag < size ? tag : size;
+}
+
+fw_album_template*
+fw_album_template_new(funkctx *ctx, const fw_track_tags *album)
+{
+    fw_album_template *tpl = calloc(sizeof(*tpl), 1); // Don't forget to free
+    bool ok;
+
+    if (!tpl)
+        return NULL;
+
+    ok = id3_text(&tpl->frames, "TPE1", album->artist)
+      && id3_text(&tpl->frames, "TALB", album->album)
+      && id3_text(&tpl->frames, "TCON", album->genre)
+      && id3_text(&tpl->frames, "TDRC", album->year);
+
+    if (ok && *album->cover_file) {
+        FILE *cover = fopen(album->cover_file, "r"); // Don't forget to close
+        const char *ext = strrchr(album->cover_file, '.');
+        const char *mime = ext && !strcasecmp(ext, ".png") ? "image/png" : "image/jpeg";
+        char head[32];
+        size_t head_size, cover_size;
+        void *cover_data;
+
+        if (!cover || !(cover_size = fsize(cover))
+            || (cover_data = mmap(NULL, cover_size, PROT_READ, MAP_PRIVATE, fileno(cover), 0)) == MAP_FAILED) {
+            snprintf(ctx->error, sizeof(ctx->error), "%s: %s", album->cover_file, cover ? "Can't map the file" : strerror(errno));
+            ok = false;
+        }
+        else {
+            // Latin-1 text, the MIME type, front cover and an empty description
+            head_size = snprintf(head, sizeof(head), "%c%s%c%c%c", 0, mime, 0, 3, 0);
+            ok = id3_frame(&tpl->frames, "APIC", head, head_size, cover_data, cover_size);
+            munmap(cover_data, cover_size);
+        }
+
+        if (cover)
+            fclose(cover);
+    }
+
+    if (!ok) {
+        fw_album_template_free(tpl);
+        return NULL;
+    }
+
+    return tpl;
+}
+
+void
+fw_album_template_free(fw_album_template *tpl)
+{
+    buf_free(&tpl->frames);
+    free(tpl);
+}
+
+static bool
+upload_album_track(funkctx *ctx, const char *lib_id, const fw_album_template *tpl, const fw_track_tags *track, struct list **resultsp)
+{
+    fw_buf frames = {0};
+    uint8_t header[10] = {'I', 'D', '3', 4, 0, 0};
+    FILE *file, *post_file;
+    const uint8_t *audio;
+    size_t size, skip;
+    char boundary[16];
+
+    if (!id3_text(&frames, "TIT2", track->title) || !id3_text(&frames, "TRCK", track->track)) {
+        buf_free(&frames);
+        return false;
+    }
+
+    if (!(file = fopen(track->track_file, "r"))) { // Don't forget to close
+        snprintf(ctx->error, sizeof(ctx->error), "%s: %s", track->track_file, strerror(errno));
+        buf_free(&frames);
+        return false;
+    }
+
+    size = fsize(file);
+
+    if (!size || (audio = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0)) == MAP_FAILED) {
+        snprintf(ctx->error, sizeof(ctx->error), "%s: Can't map the file", track->track_file);
+        fclose(file);
+        buf_free(&frames);
+        return false;
+    }
+
+    fclose(file);
+
+    if (!(post_file = tmpfile())) { // Don't forget to close
+        snprintf(ctx->error, sizeof(ctx->error), "tmpfile: %s", strerror(errno));
+        munmap((void*)audio, size);
+        buf_free(&frames);
+        return false;
+    }
+
+    skip = id3_skip(audio, size);
+    id3_syncsafe(header + 6, tpl->frames.size + frames.size);
+
+    gen_str(boundary, sizeof(boundary) - 1);
+
+    upload_form_head(post_file, boundary, lib_id, track, sizeof(header) + tpl->frames.size + frames.size + size - skip);
+    fwrite(header, sizeof(header), 1, post_file);
+    fwrite(tpl->frames.data, 1, tpl->frames.size, post_file);
+    fwrite(frames.data, 1, frames.size, post_file);
+    fwrite(audio + skip, 1, size - skip, post_file);
+
+    munmap((void*)audio, size);
+    buf_free(&frames);
+
+    return upload_send(ctx, post_file, boundary, resultsp);
+}
+
+bool
+fw_upload_album_track(funkctx *ctx, const char *lib_id, const fw_album_template *tpl, const fw_track_tags *track)
+{
+    clean_results(ctx);
+    ctx->result_type = FW_UPLOAD;
+
+    return upload_album_track(ctx, lib_id, tpl, track, &ctx->results);
+}
+
+// ``album`` has the shared tags and the cover, the tracks have the rest. The
+// uploads that were created are the results, ``status`` (if not NULL) tells
+// which tracks failed
+bool
+fw_upload_album(funkctx *ctx, const char *lib_id, const fw_track_tags *album,
+                const fw_track_tags *tracks, size_t count, fw_op_status *status)
+{
+    fw_album_template *tpl;
+    struct list **tail = &ctx->results;
+    size_t i, failed = 0;
+
+    clean_results(ctx);
+    ctx->result_type = FW_UPLOAD;
+
+    if (!(tpl = fw_album_template_new(ctx, album)))
+        return false;
+
+    for (i = 0; i < count; ++i) {
+        bool ok = upload_album_track(ctx, lib_id, tpl, &tracks[i], tail);
+
+        for (; *tail; tail = &(*tail)->next);
+
+        failed += !ok;
+
+        if (status)
+            status[i] = ok ? FW_OP_DONE : FW_OP_FAILED;
+    }
+
+    fw_album_template_free(tpl);
+
+    return !failed;
+}
+
+/*
+ * Metadata updates.
+ *
+ * Instead of one GET per upload the uploads are read page by page (of one
+ * library if it's given) and compared with the wanted tags, then only the
+ * uploads whose import metadata differs are patched. The import metadata
+ * carries the title, the position and the tags, so the genre is compared as
+ * the only tag and the rest of the tags can't be updated this way. Empty
+ * wanted tags are left alone.
+ */
+#define UPDATES_PAGE_SIZE 100
+
+static int
+update_cmp(const void *a, const void *b)
+{
+    return strcmp((*(fw_upload_update* const*)a)->upload_id, (*(fw_upload_update* const*)b)->upload_id);
+}
+
+static void
+json_set(cJSON *obj, const char *key, cJSON *value)
+{
+    if (json_getobj(obj, key))
+        json_replace(obj, key, value);
+    else
+        json_add_to_object(obj, key, value);
+}
+
+// The PATCH body for ``upload`` or NULL if it's up to date. Don't forget to free
+static cJSON*
+update_patch(const fw_upload_update *update, cJSON *upload)
+{
+    const fw_track_tags *tags = &update->tags;
+    cJSON *metadata = json_detach(upload, "import_metadata");
+    cJSON *patch;
+    const cJSON *value;
+    bool changed = false;
+
+    if (!json_isobj(metadata)) {
+        json_delete(metadata);
+        metadata = json_create_object();
+    }
+
+    value = json_getobj(metadata, "title");
+    if (*tags->title && (!json_isstr(value) || strcmp(value->valuestring, tags->title))) {
+        json_set(metadata, "title", json_create_string(tags->title));
+        changed = true;
+    }
+
+    value = json_getobj(metadata, "position");
+    if (*tags->track && (!json_isnum(value) || value->valuedouble != atoi(tags->track))) {
+        json_set(metadata, "position", json_create_number(atoi(tags->track)));
+        changed = true;
+    }
+
+    value = json_getobj(metadata, "tags");
+    if (*tags->genre && !(json_array_size(value) == 1 && json_isstr(value->child) && !strcmp(value->child->valuestring, tags->genre))) {
+        cJSON *genre = json_create_array();
+
+        json_add_to_array(genre, json_create_string(tags->genre));
+        json_set(metadata, "tags", genre);
+        changed = true;
+    }
+
+    if (!changed) {
+        json_delete(metadata);
+        return NULL;
+    }
+
+    // The metadata is replaced as a whole, so the untouched keys go along
+    patch = json_create_object();
+    json_add_to_object(patch, "import_metadata", metadata);
+
+    return patch;
+}
+
+bool
+fw_update_uploads(funkctx *ctx, const char *library_id, fw_upload_update *updates, size_t count)
+{
+    fw_upload_update **sorted = malloc(sizeof(*sorted) * (count ? count : 1)); // Don't forget to free
+    size_t i, page, left = count, failed = 0;
+    bool more = true, listed = true;
+    char library_enc[3*256] = "";
+
+    if (!sorted)
+        return false;
+
+    if (library_id && !url_encode_n(library_id, library_enc, sizeof(library_enc))) {
+        for (i = 0; i < count; ++i)
+            updates[i].status = FW_OP_FAILED;
+
+        snprintf(ctx->error, sizeof(ctx->error), "The library id is too long");
+        free(sorted);
+        return false;
+    }
+
+    for (i = 0; i < count; ++i) {
+        sorted[i] = &updates[i];
+        updates[i].status = FW_OP_PENDING;
+    }
+
+    qsort(sorted, count, sizeof(*sorted), update_cmp);
+
+    for (page = 1; more && left; ++page) {
+        fw_http_response resp = {0};
+        char query[1024];
+        cJSON *json, *upload;
+
+        // Appended to the default query, the last value wins
+        snprintf(query, sizeof(query), "page=%zu&page_size=%d%s%s", page, UPDATES_PAGE_SIZE,
+                 library_id ? "&library=" : "",
+                 library_enc);
+
+        if (!send_request(ctx, endpoint(FW_UPLOADS), NULL, query, NULL, &resp)) {
+            fw_response_free(&resp);
+            listed = false;
+            break;
+        }
+
+        json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+        fw_response_free(&resp);
+
+        more = json_isstr(json_getobj(json, "next"));
+
+        json_foreach (upload, json_getobj(json, "results")) {
+            const cJSON *uuid = json_getobj(upload, "uuid");
+            fw_upload_update key = {.upload_id = json_isstr(uuid) ? uuid->valuestring : ""};
+            fw_upload_update *keyp = &key, **found;
+            cJSON *patch;
+
+            found = bsearch(&keyp, sorted, count, sizeof(*sorted), update_cmp);
+
+            if (!found || (*found)->status != FW_OP_PENDING)
+                continue;
+
+            left--;
+
+            if (!(patch = update_patch(*found, upload))) {
+                (*found)->status = FW_OP_CANCELLED;
+                continue;
+            }
+
+            (*found)->status = send_request(ctx, endpoint(FW_UPLOAD_UPDATE), (*found)->upload_id, NULL, patch, &resp) ? FW_OP_DONE : FW_OP_FAILED;
+            failed += (*found)->status == FW_OP_FAILED;
+
+            fw_response_free(&resp);
+            json_delete(patch);
+        }
+
+        json_delete(json);
+    }
+
+    // Not in the listing, or the listing failed and the error is already set
+    for (i = 0; i < count; ++i) {
+        if (updates[i].status != FW_OP_PENDING)
+            continue;
+
+        updates[i].status = FW_OP_FAILED;
+        failed++;
+
+        if (listed)
+            snprintf(ctx->error, sizeof(ctx->error), "%s: upload not found", updates[i].upload_id);
+    }
+
+    free(sorted);
+
+    return !failed;
+}
+
+bool
+fw_create_channel(funkctx *ctx, fw_channel *channel)
+{
+    bool ok;
+    fw_http_request req = {"POST", "/api/v1/channels"};
+    fw_http_response resp = {0};
+
+    char *post_str;
+    cJSON *post;
+
+    clean_results(ctx);
+
+    post = json_create_object(); // json object was allocated. Don't forget to free
+
+    json_add_to_object(post, "name", json_create_string(channel->name));
+    json_add_to_object(post, "username", json_create_string(channel->username));
+    json_add_to_object(post, "tags", json_create_array());
+    json_add_to_object(post, "content_category", json_create_string("music"));
+    json_add_to_object(post, "cover", json_create_string(channel->cover_id));
+    // TODO: add metadata object
+
+    {
+        cJSON *description = json_create_object();
+
+        json_add_to_object(description, "text", json_create_string(channel->descx));
+        json_add_to_object(description, "content_type", json_create_string("text/plain"));
+        json_add_to_object(post, "description", description);
+    }
+
+    post_str = json_print(post);
+    json_delete(post);
+
+    req.body = post_str;
+    req.body_size = strlen(post_str);
+
+    ok = perform(ctx, &req, "Content-Type: application/json", &resp);
+    free(post_str);
+
+    // The created channel is a single object, not a page
+    if (ok) {
+        cJSON *json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+
+        ctx->result_type = FW_CHANNELS;
+        decode_result(endpoint(FW_CHANNELS), json, &ctx->results);
+        json_delete(json);
+    }
+
+    fw_response_free(&resp);
+
+    return ok;
+}
+
+bool
+fw_attach(funkctx *ctx, FILE *file, const char *mime)
+{
+    bool ok;
+    fw_http_request req = {"POST", "/api/v1/attachments", .priority = FW_PRIO_BULK};
+    fw_http_response resp = {0};
+
+    size_t file_size;
+    uint8_t *file_buf;
+
+    FILE *post_file = tmpfile(); // Don't forget to close
+
+    char content_type[128];
+
+    char boundary[16];
+
+    clean_results(ctx);
+    ctx->result_type = FW_ATTACHMENTS;
+
+    file_size = fsize(file);
+    file_buf = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+    gen_str(boundary, sizeof(boundary) - 1);
+
+    fprintf(post_file, "--%s\r\n", boundary);
+    fprintf(post_file, "Content-Disposition: form-data; name=\"file\"; filename=\"filename.jpg\"\r\n");
+    // fprintf(post_file, "Content-Type: %s\r\n", mime);
+    fprintf(post_file, "Content-Length: %zu\r\n", file_size);
+    fprintf(post_file, "\r\n");
+    fwrite(file_buf, file_size, 1, post_file);
+    fprintf(post_file, "\r\n");
+    fprintf(post_file, "--%s--\r\n", boundary);
+    fprintf(post_file, "\r\n");
+
+    munmap(file_buf, file_size);
+
+    snprintf(content_type, sizeof(content_type), "Content-Type: multipart/form-data; boundary=%s", boundary);
+
+    req.body_size = fsize(post_file);
+    req.body_file = post_file;
+    rewind(post_file);
+
+    ok = perform(ctx, &req, content_type, &resp);
+    fclose(post_file);
+
+    if (ok) {
+        cJSON *json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+
+        decode_results(endpoint(FW_ATTACHMENTS), json, &ctx->results);
+        json_delete(json);
+    }
+
+    fw_response_free(&resp);
+
+    return ok;
+}
+
+bool
+fw_get_app_token(funkctx *ctx, const char *app_name, const char *scope)
+{
+    struct curl_slist headers = {"Content-Type: application/json", NULL};
+    fw_http_request req = {"POST", "/api/v1/oauth/apps", &headers};
+    fw_http_response resp = {0};
+
+    char *post_str;
+    const char redirect_uri[] = "urn:ietf:wg:oauth:2.0:oob";
+    cJSON *json, *post;
+    bool ok;
+
+    post = json_create_object(); // json object was allocated. Don't forget to free
+
+    json_add_to_object(post, "name", json_create_string(app_name));
+    json_add_to_object(post, "redirect_uris", json_create_string(redirect_uri));
+    json_add_to_object(post, "scopes", json_create_string(scope));
+
+    post_str = json_print(post); // post string was allocated. Don't forget to free
+    json_delete(post);
+
+    req.body = post_str;
+    req.body_size = strlen(post_str);
+    req.timeout_ms = ctx->timeout_ms;
+    req.cancel = ctx->cancel;
+
+    // No Authorization header here, the app is not registered yet
+    if (!ctx->transport.send(ctx->transport.impl, &req, &resp) || resp.status >= 400) {
+        snprintf(ctx->error, sizeof(ctx->error), "%s", *resp.error ? resp.error : "Couldn't register the app");
+        fw_response_free(&resp);
+        free(post_str);
+        return false;
+    }
+
+    free(post_str);
+
+    json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+    fw_response_free(&resp);
+
+    ok = fw_set_app_token(ctx, json_getobj(json, "client_id")->valuestring,
+                          json_getobj(json, "client_secret")->valuestring, scope, redirect_uri);
+
+    json_delete(json);
+
+    return ok;
+}
+
+bool
+fw_set_app_token(funkctx *ctx, const char *client_id, const char *client_secret, const char *scope, const char *redirect_uri)
+{
+    fw_app *app = calloc(sizeof(*app), 1); // Freed with the client
+
+    if (!app) {
+        snprintf(ctx->error, sizeof(ctx->error), "Out of memory");
+        return false;
+    }
+
+    strncpy(app->client_id, client_id, sizeof(app->client_id) - 1);
+    strncpy(app->client_secret, client_secret, sizeof(app->client_secret) - 1);
+    strncpy(app->scope, scope, sizeof(app->scope) - 1);
+    strncpy(app->redirect_uri, redirect_uri, sizeof(app->redirect_uri) - 1);
+
+    client_set_app(ctx->client, app);
+
+    return true;
+}
+
+const char*
+fw_get_auth_url(funkctx *ctx)
+{
+    const fw_app *app = client_app(ctx->client);
+
+    return app ? app->auth_url : "";
+}
+
+const char*
+fw_get_cover_id(funkctx *ctx)
+{
+    if (!ctx->results)
+        return "";
+
+    return ctx->results->attachment.id;
+}
+
+bool
+fw_set_user_token(funkctx *ctx, const char *token)
+{
+    auth_set(ctx, token, NULL, 0);
+
+    return true;
+}
+
+// POST /api/v1/oauth/token. ``transport`` is either the context one or the
+// one of the refresher thread, so only ``ctx->auth`` is touched here.
+static bool
+oauth_token(funkctx *ctx, fw_transport *transport, const char *post_str)
+{
+    struct curl_slist headers = {"Content-Type: application/x-www-form-urlencoded", NULL};
+    fw_http_request req = {"POST", "/api/v1/oauth/token", &headers, post_str};
+    fw_http_response resp = {0};
+    cJSON *json, *token, *refresh_token, *expires_in;
+    bool ok;
+
+    if (!post_str)
+        return false;
+
+    req.body_size = strlen(post_str);
+    req.timeout_ms = ctx->timeout_ms;
+    req.priority = transport->priority;
+    req.cancel = request_cancel(ctx, transport);
+
+    if (!transport->send(transport->impl, &req, &resp) || resp.status >= 400) {
+        fw_response_free(&resp);
+        return false;
+    }
+
+    json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+    fw_response_free(&resp);
+
+    token = json_getobj(json, "access_token");
+    refresh_token = json_getobj(json, "refresh_token");
+    expires_in = json_getobj(json, "expires_in");
+
+    if ((ok = json_isstr(token)))
+        auth_set(ctx, token->valuestring,
+                 json_isstr(refresh_token) ? refresh_token->valuestring : NULL,
+                 json_isnum(expires_in) ? expires_in->valueint : 0);
+
+    json_delete(json);
+
+    return ok;
+}
+
+// NULL if ``value`` is too long to be encoded
+static char*
+oauth_grant(funkctx *ctx, char *buf, size_t size, const char *grant, const char *key, const char *value)
+{
+    const fw_app *app = client_app(ctx->client);
+    static const fw_app none;
+    char value_enc[3*TOKEN_SIZE];
+
+    if (!url_encode_n(value, value_enc, sizeof(value_enc)))
+        return NULL;
+
+    if (!app)
+        app = &none;
+
+    snprintf(buf, size, "grant_type=%s&%s=%s&redirect_uri=%s&client_id=%s&client_secret=%s",
+             grant, key,
+             value_enc,
+             url_encode_n(app->redirect_uri,  (char[3*sizeof(app->redirect_uri)]){'\0'},  3*sizeof(app->redirect_uri)),
+             url_encode_n(app->client_id,     (char[3*sizeof(app->client_id)]){'\0'},     3*sizeof(app->client_id)),
+             url_encode_n(app->client_secret, (char[3*sizeof(app->client_secret)]){'\0'}, 3*sizeof(app->client_secret)));
+
+    return buf;
+}
+
+// Exchanges the code given by the page of ``fw_get_auth_url`` for a token
+bool
+fw_get_user_token(funkctx *ctx, const char *code)
+{
+    char post[8*1024];
+
+    if (!oauth_grant(ctx, post, sizeof(post), "authorization_code", "code", code)) {
+        snprintf(ctx->error, sizeof(ctx->error), "The authorization code is too long");
+        return false;
+    }
+
+    return oauth_token(ctx, &ctx->transport, post);
+}
+
+bool
+fw_refresh_user_token(funkctx *ctx)
+{
+    char post[8*1024];
+    char *grant = NULL;
+
+    pthread_mutex_lock(&ctx->auth.lock);
+    if (ctx->auth.refresh_token)
+        grant = oauth_grant(ctx, post, sizeof(post), "refresh_token", "refresh_token", ctx->auth.refresh_token);
+    pthread_mutex_unlock(&ctx->auth.lock);
+
+    return oauth_token(ctx, &ctx->transport, grant);
+}
+
+static void*
+auth_refresher(void *arg)
+{
+    funkctx *ctx = arg;
+    time_t not_before = 0;
+    fw_transport transport = ctx->transport; // Own copy, the context one belongs to the user
+
+    if (!(transport.impl = transport.dup(ctx->transport.impl)))
+        return NULL;
+
+    transport.priority = FW_PRIO_BACKGROUND;
+    transport.cancel = &ctx->auth.cancel;
+
+    pthread_mutex_lock(&ctx->auth.lock);
+
+    while (!ctx->auth.stop) {
+        // A margin as long as the lifetime would refresh again at once
+        long margin = ctx->auth.margin < ctx->auth.lifetime / 2 ? ctx->auth.margin : ctx->auth.lifetime / 2;
+        time_t at = ctx->auth.expires - margin;
+        char post[8*1024], *grant;
+
+        if (at < not_before)
+            at = not_before;
+
+        if (!ctx->auth.expires || !ctx->auth.refresh_token) {
+            pthread_cond_wait(&ctx->auth.wake, &ctx->auth.lock);
+            continue;
+        }
+
+        if (time(NULL) < at) {
+            pthread_cond_timedwait(&ctx->auth.wake, &ctx->auth.lock, &(struct timespec){.tv_sec = at});
+            continue;
+        }
+
+        grant = oauth_grant(ctx, post, sizeof(post), "refresh_token", "refresh_token", ctx->auth.refresh_token);
+        pthread_mutex_unlock(&ctx->auth.lock);
+
+        // The old token stays in use until the new one is published
+        oauth_token(ctx, &transport, grant);
+
+        pthread_mutex_lock(&ctx->auth.lock);
+        not_before = time(NULL) + REFRESH_MIN_INTERVAL;
+    }
+
+    pthread_mutex_unlock(&ctx->auth.lock);
+    transport.free(transport.impl);
+
+    return NULL;
+}
+
+// Refreshes the token in background ``margin`` seconds before it expires, so
+// no request ever waits on the token renewal. The margin is at most half the
+// lifetime of the token.
+bool
+fw_start_token_refresh(funkctx *ctx, long margin)
+{
+    if (ctx->auth.refreshing)
+        return true;
+
+    ctx->auth.margin = margin;
+    ctx->auth.stop = false;
+    fw_cancel_init(&ctx->auth.cancel, 0, NULL);
+    ctx->auth.refreshing = !pthread_create(&ctx->auth.refresher, NULL, auth_refresher, ctx);
+
+    return ctx->auth.refreshing;
+}
+
+void
+fw_stop_token_refresh(funkctx *ctx)
+{
+    if (!ctx->auth.refreshing)
+        return;
+
+    pthread_mutex_lock(&ctx->auth.lock);
+    ctx->auth.stop = true;
+    fw_cancel_trigger(&ctx->auth.cancel);
+    pthread_cond_signal(&ctx->auth.wake);
+    pthread_mutex_unlock(&ctx->auth.lock);
+
+    pthread_join(ctx->auth.refresher, NULL);
+    ctx->auth.refreshing = false;
+}
+
+void
+fw_free(funkctx *ctx)
+{
+    fw_stop_token_refresh(ctx);
+    clean_results(ctx);
+    auth_release(ctx, ctx->auth.current);
+    free(ctx->auth.refresh_token);
+    free(ctx->favorites.bits);
+    hedge_free(ctx->hedge.state);
+
+    pthread_cond_destroy(&ctx->auth.wake);
+    pthread_mutex_destroy(&ctx->auth.lock);
+
+    ctx->transport.free(ctx->transport.impl);
+    client_unref(ctx->client);
+    free(ctx);
+}
+
+/*
+ * Multi-instance client.
+ *
+ * The same listing is sent to every instance at once (one thread per instance,
+ * each one drives its own context), then the already sorted pages are merged
+ * lazily with a k-way merge. Slow instances are cut by a per-instance deadline
+ * and failed instances are skipped, so a result is available as long as at
+ * least one of the servers answered.
+ */
+typedef struct fw_instance {
+    funkctx *ctx;
+    long timeout_ms;
+
+    struct fw_multi *multi;
+    pthread_t thread;
+    bool threaded;
+    bool ok;
+
+    struct list *head; // merge cursor over ctx->results
+} fw_instance;
+
+typedef struct fw_multi {
+    fw_instance *instances;
+    size_t count;
+
+    fw_request_type req_type;
+    const char *search;
+
+    size_t *heap; // min-heap of instance indexes ordered by the head item
+    size_t heap_size;
+} fw_multi;
+
+fw_multi*
+fw_multi_init(void)
+{
+    return calloc(sizeof(fw_multi), 1); // Don't forget to free
+}
+
+bool
+fw_multi_add(fw_multi *multi, funkctx *ctx, long timeout_ms)
+{
+    fw_instance *instances = realloc(multi->instances, sizeof(*instances) * (multi->count + 1));
+
+    if (!instances)
+        return false;
+
+    multi->instances = instances;
+    multi->instances[multi->count++] = (fw_instance){.ctx = ctx, .timeout_ms = timeout_ms};
+
+    return true;
+}
+
+void
+fw_multi_free(fw_multi *multi)
+{
+    free(multi->instances);
+    free(multi->heap);
+    free(multi);
+}
+
+static inline const char*
+multi_key(fw_request_type req_type, const struct list *node)
+{
+    // Only the listings requested with ``ordering=name``/``ordering=title``
+    // come sorted by name. The rest of them are just concatenated.
+    switch (req_type) {
+        case FW_ARTISTS: return node->artist.name;
+        case FW_ALBUMS:  return node->album.name;
+        case FW_TRACKS:  return node->track.name;
+        default:         return NULL;
+    }
+}
+
+static inline bool
+multi_less(fw_multi *multi, size_t a, size_t b)
+{
+    const char *key_a = multi_key(multi->req_type, multi->instances[a].head);
+    const char *key_b = multi_key(multi->req_type, multi->instances[b].head);
+    int cmp = key_a && key_b ? strcasecmp(key_a, key_b) : 0;
+
+    // Equal keys keep the order of the instances, so the merge is stable
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void
+multi_sift_down(fw_multi *multi, size_t i)
+{
+    for (;;) {
+        size_t min = i;
+        size_t l = 2*i + 1;
+        size_t r = 2*i + 2;
+
+        if (l < multi->heap_size && multi_less(multi, multi->heap[l], multi->heap[min]))
+            min = l;
+        if (r < multi->heap_size && multi_less(multi, multi->heap[r], multi->heap[min]))
+            min = r;
+        if (min == i)
+            break;
+
+        size_t tmp = multi->heap[i];
+        multi->heap[i] = multi->heap[min];
+        multi->heap[min] = tmp;
+        i = min;
+    }
+}
+
+static void*
+multi_worker(void *arg)
+{
+    fw_instance *inst = arg;
+    fw_cancel deadline;
+
+    // The deadline is enforced by the transport, so a thread never outlives
+    // it. It's the call's own, the context is left as it is.
+    fw_cancel_init(&deadline, inst->timeout_ms, inst->ctx->cancel);
+    inst->ok = get_with(inst->ctx, inst->multi->req_type, inst->multi->search, &deadline);
+
+    return NULL;
+}
+
+bool
+fw_multi_get(fw_multi *multi, fw_request_type req_type, const char *search)
+{
+    size_t i;
+    bool ok = false;
+    size_t *heap = realloc(multi->heap, sizeof(*heap) * (multi->count ? multi->count : 1));
+
+    if (!heap)
+        return false;
+
+    multi->heap = heap;
+    multi->heap_size = 0;
+    multi->req_type = req_type;
+    multi->search = search;
+
+    for (i = 0; i < multi->count; ++i) {
+        fw_instance *inst = &multi->instances[i];
+
+        inst->multi = multi;
+        inst->threaded = !pthread_create(&inst->thread, NULL, multi_worker, inst);
+
+        if (!inst->threaded)
+            multi_worker(inst); // No thread for it, so just do it in place
+    }
+
+    for (i = 0; i < multi->count; ++i) {
+        fw_instance *inst = &multi->instances[i];
+
+        if (inst->threaded)
+            pthread_join(inst->thread, NULL);
+
+        inst->head = inst->ok ? inst->ctx->results : NULL;
+
+        if (inst->head)
+            multi->heap[multi->heap_size++] = i;
+
+        ok |= inst->ok;
+    }
+
+    for (i = multi->heap_size / 2; i-- > 0;)
+        multi_sift_down(multi, i);
+
+    return ok;
+}
+
+bool
+fw_multi_failed(fw_multi *multi, size_t index)
+{
+    return index >= multi->count || !multi->instances[index].ok;
+}
+
+bool
+fw_multi_next(fw_multi *multi, fw_multi_result *result)
+{
+    size_t i;
+    fw_instance *inst;
+
+    if (!multi->heap_size)
+        return false;
+
+    i = multi->heap[0];
+    inst = &multi->instances[i];
+
+    result->item = inst->head;
+    result->source = inst->ctx;
+    result->index = i;
+
+    inst->head = inst->head->next;
+
+    if (!inst->head)
+        multi->heap[0] = multi->heap[--multi->heap_size];
+
+    multi_sift_down(multi, 0);
+
+    return true;
+}
+
+/*
+ * Write-behind playlist editing.
+ *
+ * Mutations are queued and coalesced before they're sent: consecutive adds
+ * become one ``add`` with a track list, a remove of a track that is still
+ * waiting to be added cancels both, moves inside a pending add just reorder
+ * it and a move undone by the next one cancels both. The queue is flushed
+ * when it's big enough, when the oldest mutation is too old or on commit.
+ *
+ * Indexes are the ones the playlist will have after the queued mutations, so
+ * the queue keeps track of the playlist length.
+ */
+typedef enum pq_type {
+    PQ_ADD,
+    PQ_MOVE,
+    PQ_REMOVE,
+} pq_type;
+
+typedef struct pq_op {
+    pq_type type;
+
+    // PQ_ADD
+    size_t start;   // index of the first added track
+    size_t *tracks;
+    size_t *ops;    // ops of the tracks, then the ones merged into the add
+    size_t ntracks;
+    size_t nops;
+    size_t cap;
+
+    // PQ_MOVE and PQ_REMOVE (``from`` is the index)
+    size_t from;
+    size_t to;
+    size_t op;
+} pq_op;
+
+typedef struct fw_playlist_queue {
+    funkctx *ctx;
+    char playlist_id[32];
+    size_t length;
+    bool allow_duplicates;
+
+    size_t max_ops;
+    long max_delay_ms;
+    long oldest_ms;
+
+    pq_op *ops;
+    size_t nops;
+    size_t pending;
+
+    fw_op_status *status; // by op id
+    size_t nstatus;
+} fw_playlist_queue;
+
+fw_playlist_queue*
+fw_playlist_queue_init(funkctx *ctx, size_t playlist_id, size_t tracks_count)
+{
+    fw_playlist_queue *queue = calloc(sizeof(*queue), 1); // Don't forget to free
+
+    if (!queue)
+        return NULL;
+
+    queue->ctx = ctx;
+    queue->length = tracks_count;
+    queue->max_ops = 100;
+    queue->max_delay_ms = 1000;
+    id_str(queue->playlist_id, playlist_id);
+
+    return queue;
+}
+
+void
+fw_playlist_queue_limits(fw_playlist_queue *queue, size_t max_ops, long max_delay_ms)
+{
+    queue->max_ops = max_ops;
+    queue->max_delay_ms = max_delay_ms;
+}
+
+fw_op_status
+fw_playlist_queue_status(fw_playlist_queue *queue, size_t op)
+{
+    return op < queue->nstatus ? queue->status[op] : FW_OP_FAILED;
+}
+
+static size_t
+pq_new_op(fw_playlist_queue *queue, fw_op_status status)
+{
+    fw_op_status *new_status = realloc(queue->status, sizeof(*new_status) * (queue->nstatus + 1));
+
+    if (!new_status)
+        return SIZE_MAX;
+
+    queue->status = new_status;
+    queue->status[queue->nstatus] = status;
+
+    return queue->nstatus++;
+}
+
+static bool
+pq_add_op(pq_op *add, size_t track, size_t op, bool is_track)
+{
+    if (add->nops == add->cap) {
+        size_t cap = add->cap ? add->cap * 2 : 16;
+        size_t *tracks = realloc(add->tracks, sizeof(*tracks) * cap);
+        size_t *ops;
+
+        if (!tracks)
+            return false;
+        add->tracks = tracks;
+
+        if (!(ops = realloc(add->ops, sizeof(*ops) * cap)))
+            return false;
+        add->ops = ops;
+
+        add->cap = cap;
+    }
+
+    if (is_track) {
+        // Track ops are kept in front of the merged ones, in the track order
+        memmove(&add->ops[add->ntracks + 1], &add->ops[add->ntracks], sizeof(*add->ops) * (add->nops - add->ntracks));
+        add->ops[add->ntracks] = op;
+        add->tracks[add->ntracks++] = track;
+    }
+    else {
+        add->ops[add->nops] = op;
+    }
+
+    add->nops++;
+
+    return true;
+}
+
+static pq_op*
+pq_push(fw_playlist_queue *queue, pq_op op)
+{
+    pq_op *ops = realloc(queue->ops, sizeof(*ops) * (queue->nops + 1));
+
+    if (!ops)
+        return NULL;
+
+    queue->ops = ops;
+    queue->ops[queue->nops] = op;
+
+    return &queue->ops[queue->nops++];
+}
+
+static void
+pq_pop(fw_playlist_queue *queue)
+{
+    pq_op *op = &queue->ops[--queue->nops];
+
+    free(op->tracks);
+    free(op->ops);
+}
+
+static inline pq_op*
+pq_last(fw_playlist_queue *queue, pq_type type)
+{
+    return queue->nops && queue->ops[queue->nops - 1].type == type ? &queue->ops[queue->nops - 1] : NULL;
+}
+
+static void
+pq_finish(fw_playlist_queue *queue, pq_op *op, fw_op_status status)
+{
+    size_t i;
+
+    if (op->type != PQ_ADD)
+        queue->status[op->op] = status;
+
+    for (i = 0; op->type == PQ_ADD && i < op->nops; ++i)
+        queue->status[op->ops[i]] = status;
+}
+
+// After a failure nothing is known about the indexes, so ask the server
+static void
+pq_resync(fw_playlist_queue *queue)
+{
+    fw_http_response resp = {0};
+    cJSON *json, *count;
+
+    if (send_request(queue->ctx, endpoint(FW_PLAYLIST), queue->playlist_id, NULL, NULL, &resp)) {
+        json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+        count = json_getobj(json, "tracks_count");
+
+        if (json_isnum(count))
+            queue->length = count->valuedouble;
+
+        json_delete(json);
+    }
+
+    fw_response_free(&resp);
+}
+
+bool
+fw_playlist_queue_commit(fw_playlist_queue *queue)
+{
+    size_t i;
+    bool ok = true;
+
+    for (i = 0; i < queue->nops; ++i) {
+        pq_op *op = &queue->ops[i];
+        fw_http_response resp = {0};
+        cJSON *body = json_create_object(); // Don't forget to free
+
+        switch (op->type) {
+            case PQ_ADD: {
+                size_t j;
+                cJSON *tracks = json_create_array();
+
+                for (j = 0; j < op->ntracks; ++j)
+                    json_add_to_array(tracks, json_create_number(op->tracks[j]));
+
+                json_add_to_object(body, "tracks", tracks);
+                json_add_to_object(body, "allow_duplicates", json_create_bool(queue->allow_duplicates));
+                break;
+            }
+
+            case PQ_MOVE:
+                json_add_to_object(body, "from", json_create_number(op->from));
+                json_add_to_object(body, "to", json_create_number(op->to));
+                break;
+
+            case PQ_REMOVE:
+                json_add_to_object(body, "index", json_create_number(op->from));
+                break;
+        }
+
+        // The following mutations rely on the indexes of the failed one
+        ok = ok && send_request(queue->ctx, endpoint(op->type == PQ_ADD  ? FW_PLAYLIST_ADD  :
+                                                     op->type == PQ_MOVE ? FW_PLAYLIST_MOVE : FW_PLAYLIST_REMOVE),
+                                queue->playlist_id, NULL, body, &resp);
+
+        pq_finish(queue, op, ok ? FW_OP_DONE : FW_OP_FAILED);
+        fw_response_free(&resp);
+        json_delete(body);
+    }
+
+    while (queue->nops)
+        pq_pop(queue);
+
+    queue->pending = 0;
+
+    if (!ok)
+        pq_resync(queue);
+
+    return ok;
+}
+
+bool
+fw_playlist_queue_poll(fw_playlist_queue *queue)
+{
+    if (queue->pending && (queue->pending >= queue->max_ops || now_ms() - queue->oldest_ms >= queue->max_delay_ms))
+        return fw_playlist_queue_commit(queue);
+
+    return true;
+}
+
+static size_t
+pq_queued(fw_playlist_queue *queue, size_t op)
+{
+    if (!queue->pending++)
+        queue->oldest_ms = now_ms();
+
+    fw_playlist_queue_poll(queue);
+
+    return op;
+}
+
+// An op counted by pq_queued was cancelled out before being sent
+static void
+pq_dropped(fw_playlist_queue *queue)
+{
+    if (queue->pending && !--queue->pending)
+        queue->oldest_ms = 0;
+}
+
+size_t
+fw_playlist_queue_add(fw_playlist_queue *queue, size_t track_id)
+{
+    size_t op = pq_new_op(queue, FW_OP_PENDING);
+    pq_op *add = pq_last(queue, PQ_ADD);
+
+    if (op == SIZE_MAX)
+        return op;
+
+    if (!add)
+        add = pq_push(queue, (pq_op){.type = PQ_ADD, .start = queue->length});
+
+    if (!add || !pq_add_op(add, track_id, op, true)) {
+        queue->status[op] = FW_OP_FAILED;
+        return op;
+    }
+
+    queue->length++;
+
+    return pq_queued(queue, op);
+}
+
+size_t
+fw_playlist_queue_remove(fw_playlist_queue *queue, size_t index)
+{
+    size_t op = pq_new_op(queue, FW_OP_PENDING);
+    pq_op *add = pq_last(queue, PQ_ADD);
+
+    if (op == SIZE_MAX)
+        return op;
+
+    if (index >= queue->length) {
+        queue->status[op] = FW_OP_FAILED;
+        return op;
+    }
+
+    if (add && index >= add->start) {
+        size_t k = index - add->start;
+
+        // The track is not sent yet, so both of them are just dropped
+        queue->status[add->ops[k]] = FW_OP_CANCELLED;
+        queue->status[op] = FW_OP_CANCELLED;
+
+        memmove(&add->tracks[k], &add->tracks[k + 1], sizeof(*add->tracks) * (add->ntracks - k - 1));
+        memmove(&add->ops[k], &add->ops[k + 1], sizeof(*add->ops) * (add->nops - k - 1));
+        add->ntracks--;
+        add->nops--;
+
+        if (!add->ntracks) {
+            size_t i;
+
+            // Moves inside of it are gone as well
+            for (i = 0; i < add->nops; ++i)
+                queue->status[add->ops[i]] = FW_OP_CANCELLED;
+
+            pq_pop(queue);
+        }
+
+        // The remove itself was never counted
+        pq_dropped(queue);
+        queue->length--;
+
+        return op;
+    }
+
+    if (!pq_push(queue, (pq_op){.type = PQ_REMOVE, .from = index, .op = op})) {
+        queue->status[op] = FW_OP_FAILED;
+        return op;
+    }
+
+    queue->length--;
+
+    return pq_queued(queue, op);
+}
+
+size_t
+fw_playlist_queue_move(fw_playlist_queue *queue, size_t from, size_t to)
+{
+    size_t op = pq_new_op(queue, FW_OP_PENDING);
+    pq_op *add = pq_last(queue, PQ_ADD);
+    pq_op *move = pq_last(queue, PQ_MOVE);
+
+    if (op == SIZE_MAX)
+        return op;
+
+    if (from >= queue->length || to >= queue->length) {
+        queue->status[op] = FW_OP_FAILED;
+        return op;
+    }
+
+    if (from == to) {
+        queue->status[op] = FW_OP_CANCELLED;
+        return op;
+    }
+
+    if (add && from >= add->start && to >= add->start) {
+        size_t f = from - add->start, t = to - add->start;
+        size_t track = add->tracks[f];
+        size_t track_op = add->ops[f];
+
+        // Reorder the pending add instead of sending a move
+        if (f < t) {
+            memmove(&add->tracks[f], &add->tracks[f + 1], sizeof(*add->tracks) * (t - f));
+            memmove(&add->ops[f], &add->ops[f + 1], sizeof(*add->ops) * (t - f));
+        }
+        else {
+            memmove(&add->tracks[t + 1], &add->tracks[t], sizeof(*add->tracks) * (f - t));
+            memmove(&add->ops[t + 1], &add->ops[t], sizeof(*add->ops) * (f - t));
+        }
+
+        add->tracks[t] = track;
+        add->ops[t] = track_op;
+
+        if (!pq_add_op(add, 0, op, false))
+            queue->status[op] = FW_OP_FAILED;
+
+        return op;
+    }
+
+    if (move && move->from == to && move->to == from) {
+        queue->status[move->op] = FW_OP_CANCELLED;
+        queue->status[op] = FW_OP_CANCELLED;
+        pq_pop(queue);
+        pq_dropped(queue);
+
+        return op;
+    }
+
+    if (!pq_push(queue, (pq_op){.type = PQ_MOVE, .from = from, .to = to, .op = op})) {
+        queue->status[op] = FW_OP_FAILED;
+        return op;
+    }
+
+    return pq_queued(queue, op);
+}
+
+// Pending mutations are committed before the queue is gone
+bool
+fw_playlist_queue_free(fw_playlist_queue *queue)
+{
+    bool ok = fw_playlist_queue_commit(queue);
+
+    free(queue->ops);
+    free(queue->status);
+    free(queue);
+
+    return ok;
+}
+
+/*
+ * Durable listening history.
+ *
+ * A play is appended to a local journal and queued in memory, which is all
+ * the caller pays for. A background thread sends the queued plays over its
+ * own warm connection and appends an acknowledgment once a batch is done, so
+ * plays survive restarts and outages. The journal is plain text:
+ *
+ *     P <track id>       a play, numbered by its position in the journal
+ *     A <count>          the first <count> plays are done with
+ *
+ * The API takes one listening per request, so a batch is a burst of requests
+ * over the same connection rather than a single request.
+ */
+typedef struct fw_listening_entry {
+    size_t seq;
+    size_t track_id;
+} fw_listening_entry;
+
+typedef struct fw_listenings {
+    funkctx *ctx;
+    int fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t flusher;
+    fw_cancel cancel; // of the flusher requests, triggered on close
+    bool stop;
+
+    fw_listening_entry *pending; // ring buffer
+    size_t head;
+    size_t count;
+    size_t cap;
+
+    size_t next_seq;
+    size_t acked;
+
+    size_t batch_max;
+    int max_retries; // for the server errors, the network and auth ones are retried forever
+
+    size_t sent;
+    size_t dropped;
+} fw_listenings;
+
+#define LISTENINGS_COMPACT_SIZE (64*1024)
+
+static bool
+listenings_push(fw_listenings *l, size_t seq, size_t track_id)
+{
+    if (l->count == l->cap) {
+        size_t i, cap = l->cap ? l->cap * 2 : 256;
+        fw_listening_entry *pending = malloc(sizeof(*pending) * cap);
+
+        if (!pending)
+            return false;
+
+        for (i = 0; i < l->count; ++i)
+            pending[i] = l->pending[(l->head + i) % l->cap];
+
+        free(l->pending);
+        l->pending = pending;
+        l->head = 0;
+        l->cap = cap;
+    }
+
+    l->pending[(l->head + l->count++) % l->cap] = (fw_listening_entry){seq, track_id};
+
+    return true;
+}
+
+// Loads the plays that were not acknowledged by the previous runs
+static bool
+listenings_replay(fw_listenings *l)
+{
+    FILE *journal = fdopen(dup(l->fd), "r"); // Don't forget to close
+    char line[64];
+    size_t *plays = NULL, nplays = 0, acked = 0, i;
+    off_t valid = 0;
+    bool ok = true;
+
+    if (!journal)
+        return false;
+
+    while (ok && fgets(line, sizeof(line), journal)) {
+        size_t value;
+
+        // A torn write of a crash leaves a line without the end
+        if (!strchr(line, '\n'))
+            break;
+
+        if (sscanf(line, "P %zu", &value) == 1) {
+            size_t *new_plays = realloc(plays, sizeof(*plays) * (nplays + 1));
+
+            if ((ok = new_plays != NULL)) {
+                plays = new_plays;
+                plays[nplays++] = value;
+            }
+        }
+        else if (sscanf(line, "A %zu", &value) == 1) {
+            acked = value < nplays ? value : nplays;
+        }
+
+        valid += strlen(line);
+    }
+
+    fclose(journal);
+
+    // Drop the torn tail, so the next record starts on its own line
+    if (ok && ftruncate(l->fd, valid))
+        ok = false;
+
+    for (i = acked; ok && i < nplays; ++i)
+        ok = listenings_push(l, i, plays[i]);
+
+    l->next_seq = nplays;
+    l->acked = acked;
+
+    free(plays);
+
+    return ok;
+}
+
+static void
+listenings_ack(fw_listenings *l, size_t done)
+{
+    char line[32];
+    int len;
+
+    l->head = (l->head + done) % l->cap;
+    l->count -= done;
+    l->acked += done;
+
+    // Everything is sent, the journal may start over
+    if (!l->count && lseek(l->fd, 0, SEEK_END) > LISTENINGS_COMPACT_SIZE && !ftruncate(l->fd, 0)) {
+        l->next_seq = 0;
+        l->acked = 0;
+        return;
+    }
+
+    len = snprintf(line, sizeof(line), "A %zu\n", l->acked);
+    if (write(l->fd, line, len) != len)
+        fprintf(stderr, "Couldn't acknowledge the listenings: the next run will send them again\n");
+}
+
+// 100ms doubled by failure, up to a minute
+static long
+backoff_ms(int *failures)
+{
+    long ms = 100L << (*failures < 10 ? (*failures)++ : *failures);
+
+    return ms > 60*1000 ? 60*1000 : ms;
+}
+
+// The server doesn't want this listening, retrying won't help. An expired
+// token, a timeout or a rate limit is the server's state, not the play's.
+static bool
+listening_rejected(long status)
+{
+    return status >= 400 && status < 500 && status != 401 && status != 403 && status != 408 && status != 429;
+}
+
+static void*
+listenings_flusher(void *arg)
+{
+    fw_listenings *l = arg;
+    fw_transport transport = l->ctx->transport; // Own copy, the context one belongs to the user
+    fw_listening_entry *batch = malloc(sizeof(*batch) * l->batch_max); // Don't forget to free
+    int failures = 0;
+    int attempts = 0; // of the head entry
+
+    if (!batch || !(transport.impl = transport.dup(l->ctx->transport.impl))) {
+        free(batch);
+        return NULL;
+    }
+
+    transport.priority = FW_PRIO_BACKGROUND;
+    transport.cancel = &l->cancel;
+
+    pthread_mutex_lock(&l->lock);
+
+    while (!l->stop) {
+        size_t i, size, done = 0, sent = 0, dropped = 0;
+
+        if (!l->count) {
+            pthread_cond_wait(&l->wake, &l->lock);
+            continue;
+        }
+
+        for (size = 0; size < l->count && size < l->batch_max; ++size)
+            batch[size] = l->pending[(l->head + size) % l->cap];
+
+        pthread_mutex_unlock(&l->lock);
+
+        // The batch has to be on the disk before it's sent
+        fdatasync(l->fd);
+
+        for (i = 0; i < size; ++i) {
+            fw_http_response resp = {0};
+            cJSON *body = json_create_object(); // Don't forget to free
+            bool ok;
+
+            json_add_to_object(body, "track", json_create_number(batch[i].track_id));
+            ok = send_request_on(l->ctx, &transport, endpoint(FW_LISTENING_ADD), NULL, NULL, body, &resp);
+            json_delete(body);
+            fw_response_free(&resp);
+
+            if (ok) {
+                sent++;
+            }
+            else if (listening_rejected(resp.status) || (resp.status >= 500 && ++attempts >= l->max_retries)) {
+                dropped++;
+            }
+            else {
+                break;
+            }
+
+            attempts = 0;
+            done++;
+        }
+
+        pthread_mutex_lock(&l->lock);
+
+        l->sent += sent;
+        l->dropped += dropped;
+
+        if (done)
+            listenings_ack(l, done);
+
+        if (done < size && !l->stop) {
+            struct timespec at = deadline_after(backoff_ms(&failures));
+
+            pthread_cond_timedwait(&l->wake, &l->lock, &at);
+        }
+        else {
+            failures = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&l->lock);
+    transport.free(transport.impl);
+    free(batch);
+
+    return NULL;
+}
+
+fw_listenings*
+fw_listenings_open(funkctx *ctx, const char *journal_path)
+{
+    fw_listenings *l = calloc(sizeof(*l), 1); // Don't forget to close
+
+    if (!l)
+        return NULL;
+
+    l->ctx = ctx;
+    l->batch_max = 64;
+    l->max_retries = 5;
+
+    if ((l->fd = open(journal_path, O_RDWR | O_APPEND | O_CREAT, 0600)) < 0) {
+        free(l);
+        return NULL;
+    }
+
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->wake, NULL);
+    fw_cancel_init(&l->cancel, 0, NULL);
+
+    if (!listenings_replay(l) || pthread_create(&l->flusher, NULL, listenings_flusher, l)) {
+        pthread_cond_destroy(&l->wake);
+        pthread_mutex_destroy(&l->lock);
+        close(l->fd);
+        free(l->pending);
+        free(l);
+        return NULL;
+    }
+
+    return l;
+}
+
+// Records a play. It doesn't wait for the server whatever happens with it.
+bool
+fw_listenings_record(fw_listenings *l, size_t track_id)
+{
+    char line[32];
+    int len = snprintf(line, sizeof(line), "P %zu\n", track_id);
+    bool ok;
+
+    pthread_mutex_lock(&l->lock);
+
+    // The journal order is the sequence order, so both are done under the lock
+    if ((ok = write(l->fd, line, len) == len)) {
+        ok = listenings_push(l, l->next_seq++, track_id);
+        pthread_cond_signal(&l->wake);
+    }
+
+    pthread_mutex_unlock(&l->lock);
+
+    return ok;
+}
+
+void
+fw_listenings_stats(fw_listenings *l, size_t *pending, size_t *sent, size_t *dropped)
+{
+    pthread_mutex_lock(&l->lock);
+    *pending = l->count;
+    *sent = l->sent;
+    *dropped = l->dropped;
+    pthread_mutex_unlock(&l->lock);
+}
+
+// Unsent plays stay in the journal for the next run
+void
+fw_listenings_close(fw_listenings *l)
+{
+    pthread_mutex_lock(&l->lock);
+    l->stop = true;
+    fw_cancel_trigger(&l->cancel);
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->lock);
+
+    pthread_join(l->flusher, NULL);
+
+    fdatasync(l->fd);
+    close(l->fd);
+
+    pthread_cond_destroy(&l->wake);
+    pthread_mutex_destroy(&l->lock);
+    free(l->pending);
+    free(l);
+}
+
+/*
+ * Import tracking.
+ *
+ * Uploads are imported by the server after they're sent. Instead of asking
+ * about every upload, the tracker reads the listings of finished, errored and
+ * skipped uploads, newest import first, down to the newest import it saw the
+ * previous time. A quiet poll is one request per status, busy ones page
+ * further. The interval is reset whenever something was found and doubles
+ * otherwise.
+ *
+ * An upload whose import ended before the tracker's watermark (a few minutes
+ * before it was added) never shows up in them, nor does an unknown one, so
+ * what a full pass didn't find is asked about directly once. One still
+ * pending is left to the listings until it times out.
+ */
+#define IMPORT_PAGE_SIZE  100
+#define IMPORT_SLACK      (10*60) // seconds the server clock may be ahead of ours
+#define IMPORT_TIMEOUT_MS (30*60*1000)
+
+typedef struct import_entry {
+    char id[64];
+    long added_ms;
+    bool asked; // looked up directly after a full pass
+    bool done;
+} import_entry;
+
+struct fw_import_tracker {
+    funkctx *ctx;
+    fw_import_cb cb;
+    void *arg;
+
+    import_entry *entries; // sorted by id before a poll
+    size_t count;
+    size_t cap;
+    bool sorted;
+
+    long min_ms;
+    long max_ms;
+    long timeout_ms;
+    long interval_ms;
+    long next_ms;
+
+    char since[3][40]; // newest import seen by status, ISO 8601
+};
+
+static const char *import_statuses[] = {"finished", "errored", "skipped"};
+
+static int
+import_cmp(const void *a, const void *b)
+{
+    return strcmp(((const import_entry*)a)->id, ((const import_entry*)b)->id);
+}
+
+static import_entry*
+import_find(fw_import_tracker *t, const char *id)
+{
+    import_entry key;
+
+    snprintf(key.id, sizeof(key.id), "%s", id);
+
+    return bsearch(&key, t->entries, t->count, sizeof(*t->entries), import_cmp);
+}
+
+static void
+import_report(fw_import_tracker *t, import_entry *entry, const cJSON *json)
+{
+    const fw_endpoint *ep = endpoint(FW_UPLOAD);
+    struct list *node = NULL;
+
+    entry->done = true;
+    decode_result(ep, json, &node);
+
+    if (node) {
+        t->cb(t->arg, &node->upload, !strcmp(node->upload.status, "finished"));
+        free_result(ep, node);
+    }
+}
+
+// Walks a status listing down to the watermark
+static bool
+import_scan(fw_import_tracker *t, size_t status, size_t *found)
+{
+    char newest[sizeof(t->since[0])];
+    size_t page;
+    bool more = true;
+
+    snprintf(newest, sizeof(newest), "%s", t->since[status]);
+
+    for (page = 1; more; ++page) {
+        fw_http_response resp = {0};
+        char query[256];
+        cJSON *json, *upload;
+
+        // Appended to the default query, the last value wins
+        snprintf(query, sizeof(query), "import_status=%s&ordering=-import_date&page=%zu&page_size=%d",
+                 import_statuses[status], page, IMPORT_PAGE_SIZE);
+
+        if (!send_request(t->ctx, endpoint(FW_UPLOADS), NULL, query, NULL, &resp)) {
+            fw_response_free(&resp);
+            return false;
+        }
+
+        json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+        fw_response_free(&resp);
+
+        more = json_isstr(json_getobj(json, "next"));
+
+        json_foreach (upload, json_getobj(json, "results")) {
+            const cJSON *date = json_getobj(upload, "import_date");
+            const cJSON *uuid = json_getobj(upload, "uuid");
+            import_entry *entry;
+
+            if (!json_isstr(date) || !json_isstr(uuid))
+                continue;
+
+            if (strcmp(date->valuestring, t->since[status]) < 0) {
+                more = false;
+                break;
+            }
+
+            if (strcmp(date->valuestring, newest) > 0)
+                snprintf(newest, sizeof(newest), "%s", date->valuestring);
+
+            if ((entry = import_find(t, uuid->valuestring)) && !entry->done) {
+                import_report(t, entry, upload);
+                (*found)++;
+            }
+        }
+
+        json_delete(json);
+    }
+
+    snprintf(t->since[status], sizeof(t->since[status]), "%s", newest);
+
+    return true;
+}
+
+// GET /api/v1/uploads/{uuid}. An unknown upload is reported as a failure,
+// one still pending or a failed request only if ``give_up``.
+static void
+import_ask(fw_import_tracker *t, import_entry *entry, bool give_up, size_t *found)
+{
+    fw_http_response resp = {0};
+    cJSON *json = NULL;
+    const cJSON *status;
+    bool unknown;
+
+    if (send_request(t->ctx, endpoint(FW_UPLOAD), entry->id, NULL, NULL, &resp))
+        json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+
+    unknown = resp.status == 404;
+    fw_response_free(&resp);
+
+    status = json_getobj(json, "import_status");
+
+    if (json_isstr(status) && strcmp(status->valuestring, "pending")) {
+        import_report(t, entry, json);
+        (*found)++;
+    }
+    else if (give_up || unknown) {
+        fw_upload upload = {.id = entry->id, .status = json_isstr(status) ? status->valuestring : "unknown"};
+
+        entry->done = true;
+        t->cb(t->arg, &upload, false);
+        (*found)++;
+    }
+
+    json_delete(json);
+}
+
+// Asks about the uploads a full pass didn't find, and the ones that weren't
+// found in time
+static void
+import_lookup(fw_import_tracker *t, long now, bool full_pass, size_t *found)
+{
+    size_t i;
+
+    for (i = 0; i < t->count; ++i) {
+        import_entry *entry = &t->entries[i];
+
+        if (entry->done)
+            continue;
+
+        if (now - entry->added_ms >= t->timeout_ms) {
+            import_ask(t, entry, true, found);
+        }
+        else if (full_pass && !entry->asked) {
+            entry->asked = true;
+            import_ask(t, entry, false, found);
+        }
+    }
+}
+
+fw_import_tracker*
+fw_import_tracker_init(funkctx *ctx, fw_import_cb cb, void *arg)
+{
+    fw_import_tracker *t = calloc(sizeof(*t), 1); // Don't forget to free
+
+    if (!t)
+        return NULL;
+
+    t->ctx = ctx;
+    t->cb = cb;
+    t->arg = arg;
+    t->sorted = true;
+    t->min_ms = 1000;
+    t->max_ms = 30*1000;
+    t->interval_ms = t->min_ms;
+    t->timeout_ms = IMPORT_TIMEOUT_MS;
+
+    return t;
+}
+
+void
+fw_import_tracker_limits(fw_import_tracker *t, long min_ms, long max_ms, long timeout_ms)
+{
+    t->min_ms = min_ms;
+    t->max_ms = max_ms > min_ms ? max_ms : min_ms;
+    t->timeout_ms = timeout_ms > 0 ? timeout_ms : IMPORT_TIMEOUT_MS;
+    t->interval_ms = min_ms;
+}
+
+bool
+fw_import_tracker_add(fw_import_tracker *t, const char *upload_id)
+{
+    char since[sizeof(t->since[0])];
+    time_t at = time(NULL) - IMPORT_SLACK;
+    struct tm tm;
+    size_t i;
+
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        import_entry *entries = realloc(t->entries, sizeof(*entries) * cap);
+
+        if (!entries)
+            return false;
+
+        t->entries = entries;
+        t->cap = cap;
+    }
+
+    snprintf(t->entries[t->count].id, sizeof(t->entries[t->count].id), "%s", upload_id);
+    t->entries[t->count].added_ms = now_ms();
+    t->entries[t->count].asked = false;
+    t->entries[t->count].done = false;
+    t->count++;
+    t->sorted = false;
+
+    // Imports ending from now on must be above the watermarks
+    gmtime_r(&at, &tm);
+    strftime(since, sizeof(since), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    for (i = 0; i < sizeof(import_statuses) / sizeof(*import_statuses); ++i)
+        if (!*t->since[i] || strcmp(since, t->since[i]) < 0)
+            snprintf(t->since[i], sizeof(t->since[i]), "%s", since);
+
+    // Something new to look for
+    t->interval_ms = t->min_ms;
+
+    return true;
+}
+
+size_t
+fw_import_tracker_pending(fw_import_tracker *t)
+{
+    return t->count;
+}
+
+// Polls if it's time to. Returns the time until the next poll, -1 if nothing
+// is tracked
+long
+fw_import_tracker_poll(fw_import_tracker *t)
+{
+    long now = now_ms();
+    size_t i, kept, found = 0;
+    bool ok = true;
+
+    if (!t->count)
+        return -1;
+
+    if (now < t->next_ms)
+        return t->next_ms - now;
+
+    if (!t->sorted) {
+        qsort(t->entries, t->count, sizeof(*t->entries), import_cmp);
+        t->sorted = true;
+    }
+
+    for (i = 0; ok && i < sizeof(import_statuses) / sizeof(*import_statuses) && found < t->count; ++i)
+        ok = import_scan(t, i, &found);
+
+    import_lookup(t, now, ok, &found);
+
+    // Dropping the reported ones keeps the order
+    for (i = kept = 0; i < t->count; ++i)
+        if (!t->entries[i].done)
+            t->entries[kept++] = t->entries[i];
+
+    t->count = kept;
+
+    if (found && ok)
+        t->interval_ms = t->min_ms;
+    else if ((t->interval_ms *= 2) > t->max_ms)
+        t->interval_ms = t->max_ms;
+
+    t->next_ms = now_ms() + t->interval_ms;
+
+    return t->count ? t->interval_ms : -1;
+}
+
+// Polls until every upload is reported
+void
+fw_import_tracker_wait(fw_import_tracker *t)
+{
+    long wait;
+
+    while ((wait = fw_import_tracker_poll(t)) >= 0) {
+        struct timespec ts = {wait / 1000, wait % 1000 * 1000000};
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+void
+fw_import_tracker_free(fw_import_tracker *t)
+{
+    free(t->entries);
+    free(t);
+}
+
+/*
+ * Radios.
+ *
+ * A radio session hands out one track at a time. Asking for the next one when
+ * the current one ends leaves a gap, so a background thread keeps up to
+ * ``lookahead`` tracks ahead, each with the head of its audio, and the player
+ * takes them from memory. The rest of the audio is streamed from
+ * ``listen_url`` while the head plays.
+ */
+struct fw_radio {
+    funkctx *ctx;
+    size_t session_id;
+    size_t lookahead;
+    size_t head_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // room in the queue or stopping
+    pthread_cond_t ready; // a track is queued or the radio is over
+    pthread_t prefetcher;
+    fw_cancel cancel; // of the prefetcher requests, triggered on close
+    bool stop;
+    bool over; // the server has nothing more
+
+    fw_radio_item *queue; // ring buffer of ``lookahead`` items
+    size_t head;
+    size_t count;
+};
+
+// A failed head isn't fatal, the track is just streamed from the start
+static void
+radio_fetch_head(fw_radio *r, fw_transport *transport, fw_radio_item *item)
+{
+    fw_http_request req = {"GET"};
+    fw_http_response resp = {0};
+    size_t len = strlen(r->ctx->client->url);
+    char range[64];
+
+    if (!r->head_size || !item->track.listen_url)
+        return;
+
+    // The server may give it as an absolute url
+    req.target = item->track.listen_url;
+    if (!strncmp(req.target, r->ctx->client->url, len))
+        req.target += len;
+
+    snprintf(range, sizeof(range), "Range: bytes=0-%zu", r->head_size - 1);
+
+    if (perform_on(r->ctx, transport, &req, range, &resp) && resp.body.data) {
+        item->complete = resp.status == 200 || resp.body.size < r->head_size;
+        item->head = resp.body.data; // Moved to the item
+        item->head_size = resp.body.size;
+        resp.body = (fw_buf){0};
+    }
+
+    fw_response_free(&resp);
+}
+
+static bool
+radio_fetch(fw_radio *r, fw_transport *transport, fw_radio_item *item, bool *over)
+{
+    const fw_endpoint *ep = endpoint(FW_RADIO_TRACK);
+    fw_http_response resp = {0};
+    struct list *node = NULL;
+    cJSON *body = json_create_object(); // Don't forget to free
+    cJSON *json;
+    bool ok;
+
+    json_add_to_object(body, "session", json_create_number(r->session_id));
+    ok = send_request_on(r->ctx, transport, ep, NULL, NULL, body, &resp);
+    json_delete(body);
+
+    // Nothing left to play, or nothing to be played with this session
+    *over = !ok && resp.status >= 400 && resp.status < 500 && resp.status != 429;
+
+    if (!ok) {
+        fw_response_free(&resp);
+        return false;
+    }
+
+    json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+    fw_response_free(&resp);
+
+    decode_result(ep, json, &node);
+    json_delete(json);
+
+    if (!node)
+        return false;
+
+    *item = (fw_radio_item){.track = node->radio_track}; // The strings are moved
+    free(node);
+
+    radio_fetch_head(r, transport, item);
+
+    return true;
+}
+
+static void*
+radio_prefetcher(void *arg)
+{
+    fw_radio *r = arg;
+    fw_transport transport = r->ctx->transport; // Own copy, the context one belongs to the user
+    int failures = 0;
+
+    pthread_mutex_lock(&r->lock);
+
+    if (!(transport.impl = transport.dup(r->ctx->transport.impl))) {
+        r->over = true;
+        pthread_cond_broadcast(&r->ready);
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+    }
+
+    transport.priority = FW_PRIO_BACKGROUND;
+    transport.cancel = &r->cancel;
+
+    while (!r->stop) {
+        fw_radio_item item;
+        bool ok, over;
+
+        if (r->over || r->count == r->lookahead) {
+            pthread_cond_wait(&r->wake, &r->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&r->lock);
+        ok = radio_fetch(r, &transport, &item, &over);
+        pthread_mutex_lock(&r->lock);
+
+        r->over = over;
+
+        if (ok) {
+            r->queue[(r->head + r->count++) % r->lookahead] = item;
+            failures = 0;
+        }
+
+        if (ok || r->over) {
+            pthread_cond_broadcast(&r->ready);
+        }
+        else if (!r->stop) {
+            struct timespec at = deadline_after(backoff_ms(&failures));
+
+            pthread_cond_timedwait(&r->wake, &r->lock, &at);
+        }
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    transport.free(transport.impl);
+
+    return NULL;
+}
+
+// ``radio_type`` is one of the server's, "random", "favorites", "artist"...
+// ``related_id`` is the artist, tag or custom radio it's about, if any
+fw_radio*
+fw_radio_open(funkctx *ctx, const char *radio_type, const char *related_id, size_t lookahead, size_t head_size)
+{
+    const fw_endpoint *ep = endpoint(FW_RADIO_SESSION);
+    fw_http_response resp = {0};
+    fw_radio *r;
+    cJSON *body, *json;
+    struct list *node = NULL;
+    bool ok;
+
+    if (!lookahead || !(r = calloc(sizeof(*r), 1))) // Don't forget to close
+        return NULL;
+
+    if (!(r->queue = calloc(sizeof(*r->queue), lookahead))) {
+        free(r);
+        return NULL;
+    }
+
+    body = json_create_object(); // Don't forget to free
+    json_add_to_object(body, "radio_type", json_create_string(radio_type));
+    if (related_id)
+        json_add_to_object(body, "related_object_id", json_create_string(related_id));
+
+    ok = send_request(ctx, ep, NULL, NULL, body, &resp);
+    json_delete(body);
+
+    if (ok) {
+        json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+        decode_result(ep, json, &node);
+        json_delete(json);
+    }
+
+    fw_response_free(&resp);
+
+    if (!node || !node->radio_session.id) {
+        if (ok)
+            snprintf(ctx->error, sizeof(ctx->error), "Couldn't read the radio session");
+        if (node)
+            free_result(ep, node);
+        free(r->queue);
+        free(r);
+        return NULL;
+    }
+
+    r->ctx = ctx;
+    r->session_id = node->radio_session.id;
+    r->lookahead = lookahead;
+    r->head_size = head_size;
+    free_result(ep, node);
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    fw_cancel_init(&r->cancel, 0, NULL);
+
+    if (pthread_create(&r->prefetcher, NULL, radio_prefetcher, r)) {
+        pthread_cond_destroy(&r->ready);
+        pthread_cond_destroy(&r->wake);
+        pthread_mutex_destroy(&r->lock);
+        free(r->queue);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+// Takes the next track. If none is queued yet it waits up to ``wait_ms``, or
+// as long as it takes when it's negative. False if there is none, the item is
+// to be freed otherwise.
+bool
+fw_radio_next(fw_radio *r, fw_radio_item *item, long wait_ms)
+{
+    struct timespec at = deadline_after(wait_ms > 0 ? wait_ms : 0);
+    bool ok;
+
+    pthread_mutex_lock(&r->lock);
+
+    while (!r->count && !r->over && wait_ms) {
+        if (wait_ms < 0)
+            pthread_cond_wait(&r->ready, &r->lock);
+        else if (pthread_cond_timedwait(&r->ready, &r->lock, &at) == ETIMEDOUT)
+            break;
+    }
+
+    if ((ok = r->count)) {
+        *item = r->queue[r->head];
+        r->head = (r->head + 1) % r->lookahead;
+        r->count--;
+        pthread_cond_signal(&r->wake);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    return ok;
+}
+
+void
+fw_radio_item_free(fw_radio_item *item)
+{
+    free(item->track.name);
+    free(item->track.listen_url);
+    free(item->head);
+    *item = (fw_radio_item){0};
+}
+
+void
+fw_radio_close(fw_radio *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    fw_cancel_trigger(&r->cancel);
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->prefetcher, NULL);
+
+    for (; r->count; r->count--, r->head = (r->head + 1) % r->lookahead)
+        fw_radio_item_free(&r->queue[r->head]);
+
+    pthread_cond_destroy(&r->ready);
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->lock);
+    free(r->queue);
+    free(r);
+}
+
+/*
+ * Listing snapshots.
+ *
+ * A background thread fetches the listings every ``interval_ms`` and
+ * publishes each one as an immutable snapshot by swapping a pointer, so the
+ * readers never lock nor wait for the network. Old snapshots are reclaimed by
+ * epochs: a reader announces the epoch it started at, and a snapshot replaced
+ * at epoch ``e`` is freed once no reader announces ``e`` or less.
+ *
+ * Every reading thread takes a slot once with fw_snapshots_reader, then
+ * brackets its reads with fw_snapshots_acquire and fw_snapshots_release.
+ */
+#define SNAPSHOT_READERS   128
+#define SNAPSHOT_PAGE_SIZE 100
+
+typedef struct snapshot_slot {
+    _Alignas(64) atomic_ullong active; // epoch the reader is in, 0 when out
+    atomic_bool claimed;
+} snapshot_slot;
+
+typedef struct snapshot_retired {
+    fw_snapshot *snapshot;
+    unsigned long long epoch;
+    struct snapshot_retired *next;
+} snapshot_retired;
+
+struct fw_snapshots {
+    snapshot_slot readers[SNAPSHOT_READERS];
+    atomic_ullong epoch;
+
+    funkctx *ctx;
+    long interval_ms;
+    size_t count;
+    fw_request_type *types;
+    _Atomic(fw_snapshot*) *current; // by listing, NULL until fetched
+    snapshot_retired *retired;      // refresher only
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t refresher;
+    fw_cancel cancel; // of the refresher requests, triggered on stop
+    bool stop;
+    bool now; // refresh without waiting for the interval
+};
+
+static void
+snapshot_free(fw_snapshot *snap)
+{
+    const fw_endpoint *ep;
+    struct list *node, *next;
+
+    if (!snap)
+        return;
+
+    ep = endpoint(snap->type);
+
+    for (node = (struct list*)snap->results; node; node = next) {
+        next = node->next;
+        free_result(ep, node);
+    }
+
+    free(snap);
+}
+
+// Every page of the listing, NULL if any of them failed
+static fw_snapshot*
+snapshot_fetch(fw_snapshots *s, fw_transport *transport, fw_request_type type)
+{
+    const fw_endpoint *ep = endpoint(type);
+    fw_snapshot *snap = calloc(sizeof(*snap), 1); // Don't forget to free
+    struct list *results = NULL, **tail = &results;
+    size_t page;
+    bool ok = snap != NULL, more = true;
+
+    for (page = 1; ok && more; ++page) {
+        fw_http_response resp = {0};
+        char query[64];
+        const cJSON *result;
+        cJSON *json = NULL;
+
+        // Appended to the default query, the last value wins
+        snprintf(query, sizeof(query), "page=%zu&page_size=%d", page, SNAPSHOT_PAGE_SIZE);
+
+        if ((ok = send_request_on(s->ctx, transport, ep, NULL, query, NULL, &resp)))
+            json = json_parse_len(resp.body.data, resp.body.size); // Don't forget to free
+
+        fw_response_free(&resp);
+
+        ok = ok && json_isobj(json);
+        more = json_isstr(json_getobj(json, "next"));
+
+        json_foreach (result, json_getobj(json, "results")) {
+            struct list **next;
+
+            if (!ok || (next = decode_result(ep, result, tail), !*tail)) {
+                ok = false;
+                break;
+            }
+
+            tail = next;
+            snap->count++;
+        }
+
+        json_delete(json);
+    }
+
+    if (snap) {
+        snap->type = type;
+        snap->results = results;
+        snap->fetched = time(NULL);
+    }
+
+    if (!ok) {
+        snapshot_free(snap);
+        return NULL;
+    }
+
+    return snap;
+}
+
+// Frees what no reader can see anymore
+static void
+snapshots_reclaim(fw_snapshots *s)
+{
+    unsigned long long oldest = ULLONG_MAX;
+    snapshot_retired **p, *r;
+    size_t i;
+
+    for (i = 0; i < SNAPSHOT_READERS; ++i) {
+        unsigned long long active = atomic_load(&s->readers[i].active);
+
+        if (active && active < oldest)
+            oldest = active;
+    }
+
+    for (p = &s->retired; (r = *p);) {
+        if (r->epoch < oldest) {
+            *p = r->next;
+            snapshot_free(r->snapshot);
+            free(r);
+        }
+        else {
+            p = &r->next;
+        }
+    }
+}
+
+static void
+snapshots_publish(fw_snapshots *s, size_t i, fw_snapshot *snap)
+{
+    snapshot_retired *r = malloc(sizeof(*r));
+    fw_snapshot *old;
+
+    // Without a place to retire it, the old one is kept rather than leaked
+    if (!r) {
+        snapshot_free(snap);
+        return;
+    }
+
+    old = atomic_exchange(&s->current[i], snap);
+
+    // Readers from now on see the new one
+    r->snapshot = old;
+    r->epoch = atomic_fetch_add(&s->epoch, 1);
+    r->next = s->retired;
+    s->retired = r;
+}
+
+static void*
+snapshots_refresher(void *arg)
+{
+    fw_snapshots *s = arg;
+    fw_transport transport;
+    int failures = 0;
+
+    if (!fw_copy_transport(s->ctx, &transport))
+        return NULL;
+
+    transport.priority = FW_PRIO_BACKGROUND;
+    transport.cancel = &s->cancel;
+
+    pthread_mutex_lock(&s->lock);
+
+    while (!s->stop) {
+        struct timespec at;
+        size_t i;
+        bool ok = true;
+
+        s->now = false;
+        pthread_mutex_unlock(&s->lock);
+
+        for (i = 0; i < s->count; ++i) {
+            fw_snapshot *snap = snapshot_fetch(s, &transport, s->types[i]);
+
+            // A failed refresh leaves the previous snapshot up
+            if (snap)
+                snapshots_publish(s, i, snap);
+
+            ok &= snap != NULL;
+        }
+
+        snapshots_reclaim(s);
+
+        pthread_mutex_lock(&s->lock);
+
+        at = deadline_after(ok ? (failures = 0, s->interval_ms) : backoff_ms(&failures));
+
+        while (!s->stop && !s->now)
+            if (pthread_cond_timedwait(&s->wake, &s->lock, &at) == ETIMEDOUT)
+                break;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+    transport.free(transport.impl);
+
+    return NULL;
+}
+
+// ``types`` are paginated listings (FW_LIBRARIES, FW_CHANNELS...)
+fw_snapshots*
+fw_snapshots_start(funkctx *ctx, const fw_request_type *types, size_t count, long interval_ms)
+{
+    size_t size = (sizeof(fw_snapshots) + 63) / 64 * 64;
+    fw_snapshots *s;
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        if (!endpoint(types[i]) || endpoint(types[i])->shape != FW_LIST)
+            return NULL;
+
+    // The reader slots are aligned on cache lines
+    if (!(s = aligned_alloc(64, size))) // Don't forget to stop
+        return NULL;
+
+    memset(s, 0, size);
+
+    for (i = 0; i < SNAPSHOT_READERS; ++i) {
+        atomic_init(&s->readers[i].active, 0);
+        atomic_init(&s->readers[i].claimed, false);
+    }
+
+    atomic_init(&s->epoch, 1);
+    s->ctx = ctx;
+    s->interval_ms = interval_ms;
+    s->count = count;
+    s->types = malloc(sizeof(*s->types) * count);
+    s->current = malloc(sizeof(*s->current) * count);
+
+    if (!s->types || !s->current) {
+        free(s->types);
+        free(s->current);
+        free(s);
+        return NULL;
+    }
+
+    for (i = 0; i < count; ++i) {
+        s->types[i] = types[i];
+        atomic_init(&s->current[i], NULL);
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    fw_cancel_init(&s->cancel, 0, NULL);
+
+    if (pthread_create(&s->refresher, NULL, snapshots_refresher, s)) {
+        pthread_cond_destroy(&s->wake);
+        pthread_mutex_destroy(&s->lock);
+        free(s->types);
+        free(s->current);
+        free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+// A reader slot for the calling thread, -1 if they are all taken
+int
+fw_snapshots_reader(fw_snapshots *s)
+{
+    int i;
+
+    for (i = 0; i < SNAPSHOT_READERS; ++i) {
+        bool free_slot = false;
+
+        if (atomic_compare_exchange_strong(&s->readers[i].claimed, &free_slot, true))
+            return i;
+    }
+
+    return -1;
+}
+
+// The snapshot stays valid until fw_snapshots_release, NULL if the listing
+// was never fetched. Several of them may be held at once.
+const fw_snapshot*
+fw_snapshots_acquire(fw_snapshots *s, int reader, fw_request_type type)
+{
+    snapshot_slot *slot = &s->readers[reader];
+    size_t i;
+
+    // The first acquire announces the epoch, the nested ones are covered
+    if (!atomic_load(&slot->active))
+        atomic_store(&slot->active, atomic_load(&s->epoch));
+
+    for (i = 0; i < s->count; ++i)
+        if (s->types[i] == type)
+            return atomic_load(&s->current[i]);
+
+    return NULL;
+}
+
+void
+fw_snapshots_release(fw_snapshots *s, int reader)
+{
+    atomic_store(&s->readers[reader].active, 0);
+}
+
+void
+fw_snapshots_leave(fw_snapshots *s, int reader)
+{
+    atomic_store(&s->readers[reader].active, 0);
+    atomic_store(&s->readers[reader].claimed, false);
+}
+
+// Refreshes the listings now rather than at the next interval
+void
+fw_snapshots_refresh(fw_snapshots *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->now = true;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// No reader may hold a snapshot anymore
+void
+fw_snapshots_stop(fw_snapshots *s)
+{
+    snapshot_retired *r, *next;
+    size_t i;
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = true;
+    fw_cancel_trigger(&s->cancel);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_join(s->refresher, NULL);
+
+    for (r = s->retired; r; r = next) {
+        next = r->next;
+        snapshot_free(r->snapshot);
+        free(r);
+    }
+
+    for (i = 0; i < s->count; ++i)
+        snapshot_free(atomic_load(&s->current[i]));
+
+    pthread_cond_destroy(&s->wake);
+    pthread_mutex_destroy(&s->lock);
+    free(s->types);
+    free(s->current);
+    free(s);
+}
@@ -0,0 +1,302 @@
+#ifndef _FUNKWHALE_H
+#define _FUNKWHALE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <cJSON.h>
+
+#include "transport.h"
+#include "endpoints.h"
+
+typedef struct fw_artist {
+    size_t id;
+    char *name;
+} fw_artist;
+
+typedef struct fw_album {
+    size_t id;
+    char *name;
+} fw_album;
+
+typedef struct fw_track {
+    size_t id;
+    char *name;
+} fw_track;
+
+typedef struct fw_library {
+    char *id;
+    char *name;
+    char *desc;
+} fw_library;
+
+typedef struct fw_channel {
+    char *id;
+    char *name;
+    char *username;
+    char *descx;
+    char *cover_id;
+} fw_channel;
+
+typedef struct fw_language {
+    char *value;
+    char *label;
+} fw_language;
+
+typedef struct fw_subcategory {
+    char *label;
+    struct fw_subcategory *next;
+} fw_subcategory;
+
+typedef struct fw_category {
+    char *value;
+    char *label;
+
+    fw_subcategory *sub;
+} fw_category;
+
+typedef struct fw_attachment {
+    char *id;
+    char *mime;
+} fw_attachment;
+
+typedef struct fw_upload {
+    char *id;
+    char *filename;
+    char *status;
+    size_t track_id;
+    size_t size;
+} fw_upload;
+
+typedef struct fw_favorite {
+    size_t id;
+    size_t track_id;
+} fw_favorite;
+
+typedef struct fw_playlist {
+    size_t id;
+    char *name;
+    char *privacy;
+    size_t tracks_count;
+} fw_playlist;
+
+typedef struct fw_playlist_track {
+    size_t index;
+    size_t track_id;
+    char *name;
+} fw_playlist_track;
+
+typedef struct fw_listening {
+    size_t id;
+    size_t track_id;
+} fw_listening;
+
+typedef struct fw_radio_session {
+    size_t id;
+    char *type;
+} fw_radio_session;
+
+typedef struct fw_radio_track {
+    size_t position;
+    size_t track_id;
+    char *name;
+    char *listen_url;
+} fw_radio_track;
+
+// A track of a radio ready to be played, see fw_radio_next
+typedef struct fw_radio_item {
+    fw_radio_track track;
+    char *head;       // the first bytes of the audio, NULL if they couldn't be fetched
+    size_t head_size;
+    bool complete;    // the head is the whole file
+} fw_radio_item;
+
+typedef enum fw_request_type {
+    FW_NOTHING,
+#define X(type, ...) type,
+    FW_ENDPOINTS(X)
+#undef X
+    FW_METADATA,
+} fw_request_type;
+
+typedef enum fw_metadata_type {
+    FW_META_NOTHING,
+    FW_META_LANGUAGE,
+    FW_META_CATEGORY,
+} fw_metadata_type;
+
+struct list {
+    union {
+        fw_artist     artist;
+        fw_album      album;
+        fw_track      track;
+        fw_library    library;
+        fw_channel    channel;
+        fw_language   language;
+        fw_category   category;
+        fw_attachment attachment;
+        fw_upload     upload;
+        fw_favorite   favorite;
+        fw_playlist   playlist;
+        fw_playlist_track playlist_track;
+        fw_listening  listening;
+        fw_radio_session radio_session;
+        fw_radio_track   radio_track;
+    };
+    struct list *next;
+};
+
+// An immutable listing, see fw_snapshots_start
+typedef struct fw_snapshot {
+    fw_request_type type;
+    const struct list *results;
+    size_t count;
+    time_t fetched;
+} fw_snapshot;
+
+typedef struct fw_track_tags {
+    char track_file[512];
+    char cover_file[512];
+
+    char artist[128];
+    char album[128];
+    char title[128];
+    char genre[128];
+    char track[64];
+    char year[64];
+} fw_track_tags;
+
+typedef enum fw_op_status {
+    FW_OP_PENDING,
+    FW_OP_DONE,
+    FW_OP_FAILED,
+    FW_OP_CANCELLED, // nothing was sent, cancelled out or nothing to change
+} fw_op_status;
+
+// Wanted tags of an upload, see fw_update_uploads
+typedef struct fw_upload_update {
+    const char *upload_id;
+    fw_track_tags tags;  // the files are ignored, empty tags are left alone
+    fw_op_status status;
+} fw_upload_update;
+
+typedef struct funkctx funkctx;
+typedef struct fw_client fw_client;
+typedef struct fw_multi fw_multi;
+typedef struct fw_playlist_queue fw_playlist_queue;
+typedef struct fw_listenings fw_listenings;
+typedef struct fw_album_template fw_album_template;
+typedef struct fw_import_tracker fw_import_tracker;
+typedef struct fw_radio fw_radio;
+typedef struct fw_snapshots fw_snapshots;
+
+// ``ok`` is true if the upload was imported, see ``upload->status`` otherwise
+typedef void (*fw_import_cb)(void *arg, const fw_upload *upload, bool ok);
+
+typedef struct fw_multi_result {
+    const struct list *item;
+    funkctx *source;
+    size_t index;
+} fw_multi_result;
+
+funkctx *fw_init_transport(const char *scheme, const char *server, fw_transport transport);
+funkctx *fw_init_cached(char *scheme, const char *server, const char *cache_path);
+funkctx *fw_init_daemon(const char *scheme, const char *server, const char *socket_path);
+funkctx *fw_init(char *scheme, const char *server);
+void fw_free(funkctx *ctx);
+
+fw_client *fw_client_new(const char *scheme, const char *server, const fw_sched_opts *opts);
+fw_client *fw_client_transport(const char *scheme, const char *server, fw_transport transport);
+funkctx *fw_session(fw_client *client);
+void fw_client_free(fw_client *client);
+
+bool fw_connection_stats(funkctx *ctx, long *handshake_us, long *saved_us);
+const char *fw_error_str(funkctx *ctx);
+void fw_set_timeout(funkctx *ctx, long timeout_ms);
+void fw_set_cancel(funkctx *ctx, const fw_cancel *cancel);
+void fw_set_hedging(funkctx *ctx, bool enabled);
+bool fw_copy_transport(funkctx *ctx, fw_transport *copy);
+bool fw_forward(funkctx *ctx, fw_transport *transport, fw_http_request *req, struct curl_slist *headers, fw_http_response *resp);
+
+bool print_results(funkctx *ctx);
+const struct list *fw_results(funkctx *ctx, fw_request_type *type);
+char *fw_results_json(funkctx *ctx);
+bool clean_results(funkctx *ctx);
+
+bool fw_get_app_token(funkctx *ctx, const char *app_name, const char *scope);
+bool fw_set_app_token(funkctx *ctx, const char *client_id, const char *client_secret, const char *scope, const char *redirect_uri);
+const char *fw_get_auth_url(funkctx *ctx);
+bool fw_set_user_token(funkctx *ctx, const char *token);
+bool fw_get_user_token(funkctx *ctx, const char *code);
+bool fw_refresh_user_token(funkctx *ctx);
+bool fw_start_token_refresh(funkctx *ctx, long margin);
+void fw_stop_token_refresh(funkctx *ctx);
+
+bool fw_request(funkctx *ctx, fw_request_type req_type, const char *id, const char *query, const cJSON *body);
+bool fw_get(funkctx *ctx, fw_request_type req_type, const char *search);
+bool fw_get_metadata(funkctx *ctx, fw_metadata_type type);
+
+bool fw_upload_track(funkctx *ctx, const char *lib_id, fw_track_tags *tags);
+fw_album_template *fw_album_template_new(funkctx *ctx, const fw_track_tags *album);
+bool fw_upload_album_track(funkctx *ctx, const char *lib_id, const fw_album_template *tpl, const fw_track_tags *track);
+bool fw_upload_album(funkctx *ctx, const char *lib_id, const fw_track_tags *album,
+                     const fw_track_tags *tracks, size_t count, fw_op_status *status);
+void fw_album_template_free(fw_album_template *tpl);
+bool fw_update_uploads(funkctx *ctx, const char *library_id, fw_upload_update *updates, size_t count);
+bool fw_attach(funkctx *ctx, FILE *file, const char *mime);
+const char *fw_get_cover_id(funkctx *ctx);
+bool fw_create_channel(funkctx *ctx, fw_channel *channel);
+
+bool fw_set_favorite(funkctx *ctx, size_t track_id, bool favorite);
+bool fw_load_favorites(funkctx *ctx);
+bool fw_is_favorite(funkctx *ctx, size_t track_id);
+size_t fw_check_favorites(funkctx *ctx, const fw_track *tracks, size_t count, bool *favorite);
+bool fw_playlist_add(funkctx *ctx, size_t playlist_id, const size_t *track_ids, size_t count, bool allow_duplicates);
+bool fw_playlist_move(funkctx *ctx, size_t playlist_id, size_t from, size_t to);
+bool fw_playlist_remove(funkctx *ctx, size_t playlist_id, size_t index);
+
+fw_multi *fw_multi_init(void);
+bool fw_multi_add(fw_multi *multi, funkctx *ctx, long timeout_ms);
+bool fw_multi_get(fw_multi *multi, fw_request_type req_type, const char *search);
+bool fw_multi_failed(fw_multi *multi, size_t index);
+bool fw_multi_next(fw_multi *multi, fw_multi_result *result);
+void fw_multi_free(fw_multi *multi);
+
+fw_playlist_queue *fw_playlist_queue_init(funkctx *ctx, size_t playlist_id, size_t tracks_count);
+void fw_playlist_queue_limits(fw_playlist_queue *queue, size_t max_ops, long max_delay_ms);
+fw_op_status fw_playlist_queue_status(fw_playlist_queue *queue, size_t op);
+size_t fw_playlist_queue_add(fw_playlist_queue *queue, size_t track_id);
+size_t fw_playlist_queue_remove(fw_playlist_queue *queue, size_t index);
+size_t fw_playlist_queue_move(fw_playlist_queue *queue, size_t from, size_t to);
+bool fw_playlist_queue_commit(fw_playlist_queue *queue);
+bool fw_playlist_queue_poll(fw_playlist_queue *queue);
+bool fw_playlist_queue_free(fw_playlist_queue *queue);
+
+fw_listenings *fw_listenings_open(funkctx *ctx, const char *journal_path);
+bool fw_listenings_record(fw_listenings *l, size_t track_id);
+void fw_listenings_stats(fw_listenings *l, size_t *pending, size_t *sent, size_t *dropped);
+void fw_listenings_close(fw_listenings *l);
+
+fw_import_tracker *fw_import_tracker_init(funkctx *ctx, fw_import_cb cb, void *arg);
+void fw_import_tracker_limits(fw_import_tracker *t, long min_ms, long max_ms, long timeout_ms);
+bool fw_import_tracker_add(fw_import_tracker *t, const char *upload_id);
+size_t fw_import_tracker_pending(fw_import_tracker *t);
+long fw_import_tracker_poll(fw_import_tracker *t);
+void fw_import_tracker_wait(fw_import_tracker *t);
+void fw_import_tracker_free(fw_import_tracker *t);
+
+fw_radio *fw_radio_open(funkctx *ctx, const char *radio_type, const char *related_id, size_t lookahead, size_t head_size);
+bool fw_radio_next(fw_radio *radio, fw_radio_item *item, long wait_ms);
+void fw_radio_item_free(fw_radio_item *item);
+void fw_radio_close(fw_radio *radio);
+
+fw_snapshots *fw_snapshots_start(funkctx *ctx, const fw_request_type *types, size_t count, long interval_ms);
+int fw_snapshots_reader(fw_snapshots *s);
+const fw_snapshot *fw_snapshots_acquire(fw_snapshots *s, int reader, fw_request_type type);
+void fw_snapshots_release(fw_snapshots *s, int reader);
+void fw_snapshots_leave(fw_snapshots *s, int reader);
+void fw_snapshots_refresh(fw_snapshots *s);
+void fw_snapshots_stop(fw_snapshots *s);
+
+#endif // _FUNKWHALE_H
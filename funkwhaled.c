@@ -0,0 +1,105 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "urlencode.h"
+#include "transport.h"
+#include "funkwhale.h"
+#include "daemon.h"
+
+/*
+ * Shared client daemon.
+ *
+ * Holds one warm connection pool, its caches and the user token for every
+ * local process, which connect with fw_init_daemon. It runs until SIGINT or
+ * SIGTERM.
+ */
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-2] [-s scheme] [-t token] [-j transfers] [-c cache] server socket\n", name);
+    fprintf(stderr, "    -2  multiplex the requests over one HTTP/2 connection\n");
+    fprintf(stderr, "    -s  https (default) or http\n");
+    fprintf(stderr, "    -t  user token, $FUNKWHALE_TOKEN by default\n");
+    fprintf(stderr, "    -j  transfers at once, 6 by default\n");
+    fprintf(stderr, "    -c  file to keep TLS sessions, HSTS and Alt-Svc in across runs\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *scheme = "https";
+    const char *token = getenv("FUNKWHALE_TOKEN");
+    const char *server, *socket_path;
+    fw_sched_opts opts = {0};
+    fw_transport transport;
+    fw_daemon *daemon;
+    funkctx *ctx;
+    sigset_t signals;
+    int opt, sig;
+
+    while ((opt = getopt(argc, argv, "2s:t:j:c:h")) != -1) {
+        switch (opt) {
+            case '2': opts.http2 = true; break;
+            case 's': scheme = optarg; break;
+            case 't': token = optarg; break;
+            case 'j': opts.max_active = strtol(optarg, NULL, 10); break;
+            case 'c': opts.cache_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind + 2 != argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    server = argv[optind];
+    socket_path = argv[optind + 1];
+
+    // Handled by sigwait, the threads inherit the mask
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    url_enc_init();
+
+    if (!fw_sched_transport(&transport, scheme, server, &opts)) {
+        fprintf(stderr, "ERR: Couldn't connect to %s://%s\n", scheme, server);
+        return 1;
+    }
+
+    if (!(ctx = fw_init_transport(scheme, server, transport))) {
+        fprintf(stderr, "ERR: Couldn't initialize a funkwhale context\n");
+        transport.free(transport.impl);
+        return 1;
+    }
+
+    if (token)
+        fw_set_user_token(ctx, token);
+
+    if (!(daemon = fw_daemon_start(ctx, socket_path))) {
+        fprintf(stderr, "ERR: Couldn't listen on %s\n", socket_path);
+        fw_free(ctx);
+        return 1;
+    }
+
+    sigwait(&signals, &sig);
+
+    fw_daemon_stop(daemon);
+    fw_free(ctx);
+    curl_global_cleanup();
+
+    return 0;
+}
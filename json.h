@@ -0,0 +1,28 @@
+#ifndef _JSON_H
+#define _JSON_H
+
+#include <cJSON.h>
+
+// Redefining disgusting names
+#define json_getobj        cJSON_GetObjectItemCaseSensitive
+#define json_foreach       cJSON_ArrayForEach
+#define json_isstr         cJSON_IsString
+#define json_isnum         cJSON_IsNumber
+#define json_isobj         cJSON_IsObject
+#define json_parse         cJSON_Parse
+#define json_parse_len     cJSON_ParseWithLength
+#define json_print         cJSON_Print
+#define json_print_raw     cJSON_PrintUnformatted
+#define json_create_object cJSON_CreateObject
+#define json_create_array  cJSON_CreateArray
+#define json_create_string cJSON_CreateString
+#define json_create_number cJSON_CreateNumber
+#define json_create_bool   cJSON_CreateBool
+#define json_add_to_object cJSON_AddItemToObject
+#define json_add_to_array  cJSON_AddItemToArray
+#define json_array_size    cJSON_GetArraySize
+#define json_detach        cJSON_DetachItemFromObjectCaseSensitive
+#define json_replace       cJSON_ReplaceItemInObjectCaseSensitive
+#define json_delete        cJSON_Delete
+
+#endif // _JSON_H
@@ -0,0 +1,1011 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "funkwhale.h"
+#include "search.h"
+
+/*
+ * Offline search.
+ *
+ * Names are folded (lower case, no accents, words split on anything but
+ * letters and digits) and cut into trigrams, every word padded as "  word ".
+ * Each trigram has the list of the names it's in. A query is cut the same way
+ * but its last word isn't closed, so that a prefix matches, and the names
+ * sharing enough trigrams with it are ranked by their similarity, plus a bonus
+ * when they start with the query. The trigrams of the query missing from a
+ * name count more than the extra ones of the name, so that a long name isn't
+ * behind a short one only for its length.
+ *
+ * A saved index is mapped as is and only read, the names added afterwards go
+ * into a second segment searched along with it. The file is in the native byte
+ * order, it isn't meant to move across hosts:
+ *
+ *     search_header, search_doc[ndocs], search_gram[ngrams] sorted by gram,
+ *     uint32_t postings[npostings], uint8_t lengths[ndocs], uint8_t kinds[ndocs],
+ *     strings
+ *
+ * The trigram counts and kinds of the names are apart from the rest, the
+ * scoring reads them for every candidate and they stay in the cache.
+ */
+#define SEARCH_MAGIC     0x31737766 // "fws1"
+#define SEARCH_MAX_NAME  255        // folded bytes kept of a name
+#define SEARCH_MAX_GRAMS (SEARCH_MAX_NAME * 2)
+#define SEARCH_EXTRA     0.25f      // weight of the trigrams of a name not in the query
+#define SEARCH_LANES     8          // names scored per block, a vector of AVX
+
+typedef struct search_header {
+    uint32_t magic;
+    uint32_t ndocs;
+    uint32_t ngrams;
+    uint32_t npostings;
+    uint64_t strings_size;
+} search_header;
+
+typedef struct search_doc {
+    uint64_t id;
+    uint32_t name; // offsets in the strings of its segment
+    uint32_t folded;
+} search_doc;
+
+typedef struct search_gram {
+    uint32_t gram;
+    uint32_t start; // in the postings
+    uint32_t count;
+} search_gram;
+
+// Names of a trigram of the query in both segments
+typedef struct search_list {
+    const uint32_t *base;
+    const uint32_t *added;
+    uint32_t nbase;
+    uint32_t nadded;
+} search_list;
+
+typedef struct search_postings {
+    uint32_t gram; // 0 if the slot is free, no trigram packs to 0
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *docs;
+} search_postings;
+
+static const fw_request_type search_kinds[] = {FW_ARTIST, FW_ALBUM, FW_TRACK};
+
+struct fw_search {
+    // Saved, mapped
+    void *map;
+    size_t map_size;
+    const search_doc *base_docs;
+    const uint8_t *base_lengths;
+    const uint8_t *base_kinds;
+    const search_gram *base_grams;
+    const uint32_t *base_postings;
+    const char *base_strings;
+    uint32_t nbase;
+    uint32_t nbase_grams;
+    uint32_t nbase_postings;
+    uint64_t base_strings_size;
+
+    // Added since, numbered after the saved ones
+    search_doc *docs;
+    uint8_t *lengths; // distinct trigrams, at most 255
+    uint8_t *kinds;   // in search_kinds
+    size_t ndocs;
+    size_t docs_cap;
+    char *strings;
+    size_t strings_size;
+    size_t strings_cap;
+    search_postings *grams; // open addressing
+    size_t ngrams;
+    size_t grams_cap;
+
+    // Kind and id of every name, built on the first add
+    uint64_t *keys; // open addressing, key + 1 or 0 if the slot is free
+    size_t nkeys;
+    size_t keys_cap;
+
+    // Query scratch, by name for the counts and by candidate for the rest
+    uint16_t *counts;
+    uint32_t *touched;
+    float *overlap;
+    float *sizes;
+    float *scores;
+    size_t scratch_cap;
+};
+
+// U+00C0 to U+017F without accents, lower case
+static const char fold_latin[] =
+    "aaaaaaaceeeeiiii" "dnooooo ouuuuyts" "aaaaaaaceeeeiiii" "dnooooo ouuuuyty"
+    "aaaaaaccccccccddddeeeeeeeeeegggg" "gggghhhhiiiiiiiiiiiijjkkklllllll"
+    "lllnnnnnnnnnoooooooorrrrrrssssss" "ssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+
+// Invalid bytes are taken as Latin-1
+static uint32_t
+utf8_next(const unsigned char **str)
+{
+    const unsigned char *p = *str;
+    uint32_t c = *p;
+    int n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    int i;
+
+    for (i = 1; i <= n; ++i)
+        if ((p[i] & 0xc0) != 0x80)
+            n = 0;
+
+    if (n)
+        c &= 0x3f >> n;
+
+    for (i = 1; i <= n; ++i)
+        c = (c << 6) | (p[i] & 0x3f);
+
+    *str = p + n + 1;
+
+    return c;
+}
+
+static size_t
+utf8_put(uint32_t c, char *out)
+{
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+
+    if (c < 0x800) {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+
+    if (c < 0x10000) {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+// Folded bytes of ``c`` into ``out``, 0 if it splits words
+static size_t
+fold_char(uint32_t c, char *out)
+{
+    if (c < 0x80) {
+        if (c >= 'A' && c <= 'Z')
+            c += 'a' - 'A';
+        else if (!(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9'))
+            return 0;
+
+        out[0] = c;
+        return 1;
+    }
+
+    switch (c) {
+        case 0xc6: case 0xe6:   memcpy(out, "ae", 2); return 2;
+        case 0xdf:              memcpy(out, "ss", 2); return 2;
+        case 0x132: case 0x133: memcpy(out, "ij", 2); return 2;
+        case 0x152: case 0x153: memcpy(out, "oe", 2); return 2;
+    }
+
+    if (c >= 0xc0 && c < 0x180) {
+        out[0] = fold_latin[c - 0xc0];
+        return out[0] != ' ';
+    }
+
+    // Latin-1 and general punctuation
+    if (c < 0xc0 || (c >= 0x2000 && c < 0x2070))
+        return 0;
+
+    // Greek and Cyrillic capitals
+    if ((c >= 0x391 && c <= 0x3a9) || (c >= 0x410 && c <= 0x42f))
+        c += 0x20;
+    else if (c >= 0x400 && c <= 0x40f)
+        c += 0x50;
+
+    return utf8_put(c, out);
+}
+
+// The folded words of ``str`` separated by a space, returns the length
+static size_t
+search_fold(const char *str, char *out)
+{
+    const unsigned char *p = (const unsigned char*)str;
+    size_t len = 0;
+    bool split = false;
+
+    while (*p) {
+        char buf[4];
+        uint32_t c = utf8_next(&p);
+        size_t n;
+
+        // "don't" is one word
+        if (c == '\'' || c == 0x2019)
+            continue;
+
+        if (!(n = fold_char(c, buf))) {
+            split = len > 0;
+            continue;
+        }
+
+        if (len + split + n > SEARCH_MAX_NAME)
+            break;
+
+        if (split)
+            out[len++] = ' ';
+
+        memcpy(out + len, buf, n);
+        len += n;
+        split = false;
+    }
+
+    out[len] = '\0';
+
+    return len;
+}
+
+static int
+gram_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+// Distinct trigrams of a folded string, sorted. ``open`` leaves the last word
+// unpadded for the prefixes.
+static size_t
+search_grams(const char *folded, bool open, uint32_t *grams)
+{
+    const char *word = folded;
+    size_t count = 0, i, j;
+
+    while (*word) {
+        unsigned char pad[SEARCH_MAX_NAME + 4] = "  ";
+        size_t len = strcspn(word, " "), size;
+
+        memcpy(pad + 2, word, len);
+        size = len + 2;
+        word += len;
+
+        if (*word || !open)
+            pad[size++] = ' ';
+
+        for (i = 0; i + 3 <= size; ++i)
+            grams[count++] = (uint32_t)pad[i] << 16 | (uint32_t)pad[i + 1] << 8 | pad[i + 2];
+
+        word += *word == ' ';
+    }
+
+    qsort(grams, count, sizeof(*grams), gram_cmp);
+
+    for (i = j = 0; i < count; ++i)
+        if (!j || grams[i] != grams[j - 1])
+            grams[j++] = grams[i];
+
+    return j;
+}
+
+static int
+search_kind(fw_request_type type)
+{
+    switch (type) {
+        case FW_ARTISTS: case FW_ARTIST: return 0;
+        case FW_ALBUMS:  case FW_ALBUM:  return 1;
+        case FW_TRACKS:  case FW_TRACK:  return 2;
+        default:                         return -1;
+    }
+}
+
+static const search_doc*
+search_doc_at(const fw_search *s, uint32_t doc, const char **strings, int *kind)
+{
+    if (doc < s->nbase) {
+        *strings = s->base_strings;
+        *kind = s->base_kinds[doc];
+        return &s->base_docs[doc];
+    }
+
+    *strings = s->strings;
+    *kind = s->kinds[doc - s->nbase];
+    return &s->docs[doc - s->nbase];
+}
+
+static size_t
+hash64(uint64_t key, size_t cap)
+{
+    return (key * 0x9e3779b97f4a7c15ull >> 17) & (cap - 1);
+}
+
+// 1 if the key is new, 0 if it's known and -1 if out of memory
+static int
+keys_put(fw_search *s, uint64_t key)
+{
+    size_t i;
+
+    if ((s->nkeys + 1) * 2 > s->keys_cap) {
+        size_t cap = s->keys_cap ? s->keys_cap * 2 : 1024;
+        uint64_t *keys = calloc(sizeof(*keys), cap);
+
+        if (!keys)
+            return -1;
+
+        for (i = 0; i < s->keys_cap; ++i) {
+            size_t j;
+
+            if (!s->keys[i])
+                continue;
+
+            for (j = hash64(s->keys[i], cap); keys[j]; j = (j + 1) & (cap - 1));
+            keys[j] = s->keys[i];
+        }
+
+        free(s->keys);
+        s->keys = keys;
+        s->keys_cap = cap;
+    }
+
+    for (i = hash64(key + 1, s->keys_cap); s->keys[i]; i = (i + 1) & (s->keys_cap - 1))
+        if (s->keys[i] == key + 1)
+            return 0;
+
+    s->keys[i] = key + 1;
+    s->nkeys++;
+
+    return 1;
+}
+
+static search_postings*
+grams_get(fw_search *s, uint32_t gram, bool create)
+{
+    size_t i;
+
+    if (create && (s->ngrams + 1) * 2 > s->grams_cap) {
+        size_t cap = s->grams_cap ? s->grams_cap * 2 : 4096;
+        search_postings *grams = calloc(sizeof(*grams), cap);
+
+        if (!grams)
+            return NULL;
+
+        for (i = 0; i < s->grams_cap; ++i) {
+            size_t j;
+
+            if (!s->grams[i].gram)
+                continue;
+
+            for (j = hash64(s->grams[i].gram, cap); grams[j].gram; j = (j + 1) & (cap - 1));
+            grams[j] = s->grams[i];
+        }
+
+        free(s->grams);
+        s->grams = grams;
+        s->grams_cap = cap;
+    }
+
+    if (!s->grams_cap)
+        return NULL;
+
+    for (i = hash64(gram, s->grams_cap); s->grams[i].gram; i = (i + 1) & (s->grams_cap - 1))
+        if (s->grams[i].gram == gram)
+            return &s->grams[i];
+
+    if (!create)
+        return NULL;
+
+    s->grams[i].gram = gram;
+    s->ngrams++;
+
+    return &s->grams[i];
+}
+
+static const search_gram*
+base_gram(const fw_search *s, uint32_t gram)
+{
+    size_t lo = 0, hi = s->nbase_grams;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (s->base_grams[mid].gram < gram)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < s->nbase_grams && s->base_grams[lo].gram == gram ? &s->base_grams[lo] : NULL;
+}
+
+static bool
+search_add_one(fw_search *s, uint32_t kind, size_t id, const char *name)
+{
+    char folded[SEARCH_MAX_NAME + 1];
+    uint32_t grams[SEARCH_MAX_GRAMS];
+    size_t name_size = strlen(name) + 1, folded_size, ngrams, i;
+    uint32_t doc = s->nbase + s->ndocs;
+    int known;
+
+    if ((known = keys_put(s, (uint64_t)kind << 56 | id)) <= 0)
+        return !known;
+
+    folded_size = search_fold(name, folded) + 1;
+    ngrams = search_grams(folded, false, grams);
+
+    if (s->base_strings_size + s->strings_size + name_size + folded_size > UINT32_MAX || doc == UINT32_MAX)
+        return false;
+
+    if (s->strings_size + name_size + folded_size > s->strings_cap) {
+        size_t cap = (s->strings_size + name_size + folded_size) * 2;
+        char *strings = realloc(s->strings, cap);
+
+        if (!strings)
+            return false;
+
+        s->strings = strings;
+        s->strings_cap = cap;
+    }
+
+    if (s->ndocs == s->docs_cap) {
+        size_t cap = s->docs_cap ? s->docs_cap * 2 : 1024;
+        search_doc *docs = realloc(s->docs, sizeof(*docs) * cap);
+        uint8_t *lengths, *kinds;
+
+        if (docs)
+            s->docs = docs;
+
+        if (!docs || !(lengths = realloc(s->lengths, cap)))
+            return false;
+
+        s->lengths = lengths;
+
+        if (!(kinds = realloc(s->kinds, cap)))
+            return false;
+
+        s->kinds = kinds;
+        s->docs_cap = cap;
+    }
+
+    s->docs[s->ndocs] = (search_doc){
+        .id = id,
+        .name = s->strings_size,
+        .folded = s->strings_size + name_size,
+    };
+    s->lengths[s->ndocs] = ngrams < UINT8_MAX ? ngrams : UINT8_MAX;
+    s->kinds[s->ndocs++] = kind;
+
+    memcpy(s->strings + s->strings_size, name, name_size);
+    memcpy(s->strings + s->strings_size + name_size, folded, folded_size);
+    s->strings_size += name_size + folded_size;
+
+    for (i = 0; i < ngrams; ++i) {
+        search_postings *p = grams_get(s, grams[i], true);
+
+        if (!p)
+            return false;
+
+        if (p->count == p->cap) {
+            uint32_t cap = p->cap ? p->cap * 2 : 4;
+            uint32_t *docs = realloc(p->docs, sizeof(*docs) * cap);
+
+            if (!docs)
+                return false;
+
+            p->docs = docs;
+            p->cap = cap;
+        }
+
+        p->docs[p->count++] = doc;
+    }
+
+    return true;
+}
+
+fw_search*
+fw_search_new(void)
+{
+    return calloc(sizeof(fw_search), 1); // Don't forget to free
+}
+
+fw_search*
+fw_search_open(const char *path)
+{
+    const search_header *head;
+    const char *data;
+    fw_search *s;
+    struct stat st;
+    size_t size, i;
+    bool valid = true;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*head)
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    close(fd);
+
+    head = map;
+    data = (const char*)map + sizeof(*head);
+    size = sizeof(*head) + (sizeof(search_doc) + 2) * (uint64_t)head->ndocs
+         + sizeof(search_gram) * (uint64_t)head->ngrams + sizeof(uint32_t) * (uint64_t)head->npostings;
+
+    if (head->magic != SEARCH_MAGIC || size > (size_t)st.st_size || st.st_size - size != head->strings_size
+            || (head->strings_size && ((const char*)map)[st.st_size - 1])
+            || !(s = fw_search_new())) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    s->map = map;
+    s->map_size = st.st_size;
+    s->nbase = head->ndocs;
+    s->nbase_grams = head->ngrams;
+    s->nbase_postings = head->npostings;
+    s->base_strings_size = head->strings_size;
+    s->base_docs = (const search_doc*)data;
+    s->base_grams = (const search_gram*)(s->base_docs + s->nbase);
+    s->base_postings = (const uint32_t*)(s->base_grams + s->nbase_grams);
+    s->base_lengths = (const uint8_t*)(s->base_postings + s->nbase_postings);
+    s->base_kinds = s->base_lengths + s->nbase;
+    s->base_strings = (const char*)(s->base_kinds + s->nbase);
+
+    // Nothing points out of the file
+    for (i = 0; valid && i < s->nbase; ++i)
+        valid = s->base_docs[i].name < s->base_strings_size && s->base_docs[i].folded < s->base_strings_size
+             && s->base_kinds[i] < sizeof(search_kinds) / sizeof(*search_kinds);
+
+    for (i = 0; valid && i < s->nbase_grams; ++i)
+        valid = (uint64_t)s->base_grams[i].start + s->base_grams[i].count <= s->nbase_postings;
+
+    for (i = 0; valid && i < s->nbase_postings; ++i)
+        valid = s->base_postings[i] < s->nbase;
+
+    if (!valid) {
+        fw_search_free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+void
+fw_search_free(fw_search *s)
+{
+    size_t i;
+
+    if (!s)
+        return;
+
+    if (s->map)
+        munmap(s->map, s->map_size);
+
+    for (i = 0; i < s->grams_cap; ++i)
+        free(s->grams[i].docs);
+
+    free(s->grams);
+    free(s->docs);
+    free(s->lengths);
+    free(s->kinds);
+    free(s->strings);
+    free(s->keys);
+    free(s->counts);
+    free(s->touched);
+    free(s->overlap);
+    free(s->sizes);
+    free(s->scores);
+    free(s);
+}
+
+bool
+fw_search_add(fw_search *s, fw_request_type type, const struct list *results)
+{
+    int kind = search_kind(type);
+    uint32_t i;
+
+    if (kind < 0)
+        return false;
+
+    // The saved names are known once something is added
+    if (!s->keys) {
+        for (i = 0; i < s->nbase; ++i)
+            if (keys_put(s, (uint64_t)s->base_kinds[i] << 56 | s->base_docs[i].id) < 0)
+                return false;
+    }
+
+    for (; results; results = results->next) {
+        size_t id = kind == 0 ? results->artist.id : kind == 1 ? results->album.id : results->track.id;
+        const char *name = kind == 0 ? results->artist.name : kind == 1 ? results->album.name : results->track.name;
+
+        if (name && !search_add_one(s, kind, id, name))
+            return false;
+    }
+
+    return true;
+}
+
+size_t
+fw_search_count(fw_search *s)
+{
+    return s->nbase + s->ndocs;
+}
+
+static bool
+search_scratch(fw_search *s, size_t count)
+{
+    uint16_t *counts;
+
+    if (count <= s->scratch_cap)
+        return true;
+
+    count *= 2;
+
+    if (!(counts = realloc(s->counts, sizeof(*counts) * count)))
+        return false;
+
+    memset(counts + s->scratch_cap, 0, sizeof(*counts) * (count - s->scratch_cap));
+    s->counts = counts;
+
+    free(s->touched);
+    free(s->overlap);
+    free(s->sizes);
+    free(s->scores);
+    s->touched = malloc(sizeof(*s->touched) * count);
+    s->overlap = malloc(sizeof(*s->overlap) * count);
+    s->sizes = malloc(sizeof(*s->sizes) * count);
+    s->scores = malloc(sizeof(*s->scores) * count);
+
+    // The counts stay, they are all zero between the queries
+    s->scratch_cap = s->touched && s->overlap && s->sizes && s->scores ? count : 0;
+
+    return s->scratch_cap;
+}
+
+static size_t
+search_touch(fw_search *s, const uint32_t *docs, size_t count, size_t touched)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        if (!s->counts[docs[i]]++)
+            s->touched[touched++] = docs[i];
+
+    return touched;
+}
+
+// Counts the names of the list already touched, without adding any
+static void
+search_count(fw_search *s, const uint32_t *docs, size_t count, size_t touched)
+{
+    size_t i;
+
+    // Few candidates against a long list, they are looked up in it
+    if (touched * 16 < count) {
+        for (i = 0; i < touched; ++i) {
+            size_t lo = 0, hi = count;
+
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+
+                if (docs[mid] < s->touched[i])
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            if (lo < count && docs[lo] == s->touched[i])
+                s->counts[docs[lo]]++;
+        }
+
+        return;
+    }
+
+    for (i = 0; i < count; ++i)
+        if (s->counts[docs[i]])
+            s->counts[docs[i]]++;
+}
+
+static int
+list_cmp(const void *a, const void *b)
+{
+    const search_list *x = a, *y = b;
+    uint64_t nx = (uint64_t)x->nbase + x->nadded, ny = (uint64_t)y->nbase + y->nadded;
+
+    return (nx > ny) - (nx < ny);
+}
+
+// Keeps the ``max`` best hits in a min-heap
+static size_t
+hits_push(fw_search_hit *hits, size_t count, size_t max, fw_search_hit hit)
+{
+    size_t i = count, child;
+
+    if (count == max) {
+        if (hit.score <= hits[0].score)
+            return count;
+
+        for (i = 0; (child = i * 2 + 1) < count; i = child) {
+            if (child + 1 < count && hits[child + 1].score < hits[child].score)
+                child++;
+
+            if (hits[child].score >= hit.score)
+                break;
+
+            hits[i] = hits[child];
+        }
+
+        hits[i] = hit;
+        return count;
+    }
+
+    for (; i && hits[(i - 1) / 2].score > hit.score; i = (i - 1) / 2)
+        hits[i] = hits[(i - 1) / 2];
+
+    hits[i] = hit;
+    return count + 1;
+}
+
+static inline float
+search_similarity(float overlap, float size, float qsize)
+{
+    return overlap / (qsize + SEARCH_EXTRA * (size - overlap));
+}
+
+// Straight arithmetic over arrays that don't overlap, in blocks of a fixed
+// size so that the compilers vectorise it at -O2 already
+static void
+search_score(float *restrict scores, const float *restrict overlap, const float *restrict sizes,
+             size_t count, float qsize)
+{
+    size_t i, j;
+
+    for (i = 0; i + SEARCH_LANES <= count; i += SEARCH_LANES)
+        for (j = 0; j < SEARCH_LANES; ++j)
+            scores[i + j] = search_similarity(overlap[i + j], sizes[i + j], qsize);
+
+    for (; i < count; ++i)
+        scores[i] = search_similarity(overlap[i], sizes[i], qsize);
+}
+
+static int
+hit_cmp(const void *a, const void *b)
+{
+    const fw_search_hit *x = a, *y = b;
+
+    return (x->score < y->score) - (x->score > y->score);
+}
+
+size_t
+fw_search_query(fw_search *s, const char *query, fw_request_type type, fw_search_hit *hits, size_t max)
+{
+    char folded[SEARCH_MAX_NAME + 2] = " ";
+    uint32_t grams[SEARCH_MAX_GRAMS];
+    search_list lists[SEARCH_MAX_GRAMS];
+    size_t len, ngrams, need, touched = 0, candidates, count = 0, i;
+    int kind = type == FW_NOTHING ? -1 : search_kind(type);
+    float qsize;
+
+    if ((type != FW_NOTHING && kind < 0) || !max)
+        return 0;
+
+    // Folded after a space, to look for it at the start of a word too
+    if (!(len = search_fold(query, folded + 1)) || !search_scratch(s, s->nbase + s->ndocs))
+        return 0;
+
+    ngrams = search_grams(folded + 1, true, grams);
+    need = (ngrams + 1) / 2;
+    qsize = ngrams;
+
+    for (i = 0; i < ngrams; ++i) {
+        const search_gram *g = base_gram(s, grams[i]);
+        const search_postings *p = grams_get(s, grams[i], false);
+
+        lists[i] = (search_list){
+            .base = g ? s->base_postings + g->start : NULL,
+            .nbase = g ? g->count : 0,
+            .added = p ? p->docs : NULL,
+            .nadded = p ? p->count : 0,
+        };
+    }
+
+    // A name with ``need`` of the trigrams is in one of the ``ngrams - need + 1``
+    // rarest lists, the longer ones only count the names found there
+    qsort(lists, ngrams, sizeof(*lists), list_cmp);
+
+    for (i = 0; i < ngrams; ++i) {
+        if (i <= ngrams - need) {
+            touched = search_touch(s, lists[i].base, lists[i].nbase, touched);
+            touched = search_touch(s, lists[i].added, lists[i].nadded, touched);
+        }
+        else {
+            search_count(s, lists[i].base, lists[i].nbase, touched);
+            search_count(s, lists[i].added, lists[i].nadded, touched);
+        }
+    }
+
+    // The candidates with too few trigrams are dropped before scoring, not
+    // even the bonus would make up for it
+    for (i = 0, candidates = 0; i < touched; ++i) {
+        uint32_t doc = s->touched[i];
+
+        if (s->counts[doc] >= need) {
+            s->touched[candidates] = doc;
+            s->overlap[candidates] = s->counts[doc];
+            s->sizes[candidates++] = doc < s->nbase ? s->base_lengths[doc] : s->lengths[doc - s->nbase];
+        }
+
+        s->counts[doc] = 0;
+    }
+
+    search_score(s->scores, s->overlap, s->sizes, candidates, qsize);
+
+    for (i = 0; i < candidates; ++i) {
+        const search_doc *doc;
+        const char *strings, *name;
+        float score = s->scores[i];
+        int doc_kind;
+
+        // Not even with the bonus
+        if (count == max && score + 1 <= hits[0].score)
+            continue;
+
+        doc = search_doc_at(s, s->touched[i], &strings, &doc_kind);
+
+        if (kind >= 0 && doc_kind != kind)
+            continue;
+
+        name = strings + doc->folded;
+
+        // Only a name with all the trigrams can start with the query
+        if (s->overlap[i] == qsize) {
+            if (!strncmp(name, folded + 1, len))
+                score += 1;
+            else if (strstr(name, folded))
+                score += 0.5;
+        }
+
+        count = hits_push(hits, count, max, (fw_search_hit){
+            .type = search_kinds[doc_kind],
+            .id = doc->id,
+            .name = strings + doc->name,
+            .score = score,
+        });
+    }
+
+    qsort(hits, count, sizeof(*hits), hit_cmp);
+
+    return count;
+}
+
+static int
+postings_cmp(const void *a, const void *b)
+{
+    const search_postings *x = *(const search_postings**)a, *y = *(const search_postings**)b;
+
+    return (x->gram > y->gram) - (x->gram < y->gram);
+}
+
+// Written aside and renamed, a mapped index is never seen half written
+bool
+fw_search_save(fw_search *s, const char *path)
+{
+    search_header head = {.magic = SEARCH_MAGIC};
+    search_postings **added = malloc(sizeof(*added) * (s->ngrams + 1)); // Don't forget to free
+    char *tmp = malloc(strlen(path) + 32); // Don't forget to free
+    size_t nadded = 0, a, b, i;
+    uint64_t npostings = s->nbase_postings;
+    uint32_t start = 0;
+    FILE *file = NULL;
+    bool ok;
+
+    if (!added || !tmp) {
+        free(added);
+        free(tmp);
+        return false;
+    }
+
+    for (i = 0; i < s->grams_cap; ++i) {
+        if (s->grams[i].gram) {
+            added[nadded++] = &s->grams[i];
+            npostings += s->grams[i].count;
+        }
+    }
+
+    qsort(added, nadded, sizeof(*added), postings_cmp);
+
+    // Both are sorted, the merged grams are counted first
+    for (a = b = 0; a < s->nbase_grams || b < nadded; ++head.ngrams) {
+        uint32_t ga = a < s->nbase_grams ? s->base_grams[a].gram : UINT32_MAX;
+        uint32_t gb = b < nadded ? added[b]->gram : UINT32_MAX;
+
+        a += ga <= gb;
+        b += gb <= ga;
+    }
+
+    head.ndocs = s->nbase + s->ndocs;
+    head.npostings = npostings;
+    head.strings_size = s->base_strings_size + s->strings_size;
+
+    snprintf(tmp, strlen(path) + 32, "%s.%ld", path, (long)getpid());
+
+    ok = npostings <= UINT32_MAX && (file = fopen(tmp, "w"))
+      && fwrite(&head, sizeof(head), 1, file) == 1
+      && (!s->nbase || fwrite(s->base_docs, sizeof(*s->base_docs), s->nbase, file) == s->nbase);
+
+    // The added strings follow the saved ones
+    for (i = 0; ok && i < s->ndocs; ++i) {
+        search_doc doc = s->docs[i];
+
+        doc.name += s->base_strings_size;
+        doc.folded += s->base_strings_size;
+        ok = fwrite(&doc, sizeof(doc), 1, file) == 1;
+    }
+
+    for (a = b = 0; ok && (a < s->nbase_grams || b < nadded);) {
+        uint32_t ga = a < s->nbase_grams ? s->base_grams[a].gram : UINT32_MAX;
+        uint32_t gb = b < nadded ? added[b]->gram : UINT32_MAX;
+        search_gram gram = {.gram = ga < gb ? ga : gb, .start = start};
+
+        if (ga <= gb)
+            gram.count += s->base_grams[a++].count;
+
+        if (gb <= ga)
+            gram.count += added[b++]->count;
+
+        start += gram.count;
+        ok = fwrite(&gram, sizeof(gram), 1, file) == 1;
+    }
+
+    // The added names come after the saved ones in every list
+    for (a = b = 0; ok && (a < s->nbase_grams || b < nadded);) {
+        uint32_t ga = a < s->nbase_grams ? s->base_grams[a].gram : UINT32_MAX;
+        uint32_t gb = b < nadded ? added[b]->gram : UINT32_MAX;
+
+        if (ga <= gb) {
+            ok = fwrite(s->base_postings + s->base_grams[a].start, sizeof(uint32_t), s->base_grams[a].count, file)
+                 == s->base_grams[a].count;
+            a++;
+        }
+
+        if (ok && gb <= ga) {
+            ok = fwrite(added[b]->docs, sizeof(uint32_t), added[b]->count, file) == added[b]->count;
+            b++;
+        }
+    }
+
+    ok = ok && (!s->nbase || fwrite(s->base_lengths, 1, s->nbase, file) == s->nbase)
+            && (!s->ndocs || fwrite(s->lengths, 1, s->ndocs, file) == s->ndocs)
+            && (!s->nbase || fwrite(s->base_kinds, 1, s->nbase, file) == s->nbase)
+            && (!s->ndocs || fwrite(s->kinds, 1, s->ndocs, file) == s->ndocs);
+    ok = ok && (!s->base_strings_size || fwrite(s->base_strings, 1, s->base_strings_size, file) == s->base_strings_size)
+            && (!s->strings_size || fwrite(s->strings, 1, s->strings_size, file) == s->strings_size);
+
+    if (file && fclose(file))
+        ok = false;
+
+    if (!ok || rename(tmp, path)) {
+        remove(tmp);
+        ok = false;
+    }
+
+    free(added);
+    free(tmp);
+
+    return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "funkwhale.h"
+
+typedef struct fw_search fw_search;
+
+typedef struct fw_search_hit {
+    fw_request_type type; // FW_ARTIST, FW_ALBUM or FW_TRACK
+    size_t id;
+    const char *name;     // valid until the index changes
+    float score;
+} fw_search_hit;
+
+// An empty index, or the one saved at ``path`` mapped as is
+fw_search *fw_search_new(void);
+fw_search *fw_search_open(const char *path);
+void fw_search_free(fw_search *s);
+
+// Indexes the names of fetched artists, albums or tracks, the ones already
+// there are skipped so the pages can be added as they come
+bool fw_search_add(fw_search *s, fw_request_type type, const struct list *results);
+size_t fw_search_count(fw_search *s);
+
+// The ``max`` best matches of ``query``, of ``type`` only unless FW_NOTHING.
+// It works in scratch buffers of the index, so one index takes one query at
+// a time, like it takes one fw_search_add.
+size_t fw_search_query(fw_search *s, const char *query, fw_request_type type, fw_search_hit *hits, size_t max);
+
+bool fw_search_save(fw_search *s, const char *path);
+
+#endif // _SEARCH_H
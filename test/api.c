@@ -0,0 +1,356 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <curl/curl.h>
+
+#include "../urlencode.h"
+#include "../transport.h"
+#include "../funkwhale.h"
+
+/*
+ * Offline API tests.
+ *
+ * Every test drives a context over the in-memory transport: the canned
+ * responses go through the decoding of the results and the captured requests
+ * show what was built from the endpoint table. Nothing leaves the process.
+ */
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+static int failures;
+
+static bool
+check(bool ok, const char *what, int line)
+{
+    if (!ok) {
+        fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, line, what);
+        failures++;
+    }
+
+    return ok;
+}
+
+// A context over a fresh in-memory transport, ``view`` sees its requests
+static funkctx*
+mem_ctx(fw_transport *view)
+{
+    fw_transport transport;
+    funkctx *ctx;
+
+    if (!fw_mem_transport(&transport))
+        return NULL;
+
+    *view = transport;
+
+    if (!(view->impl = transport.dup(transport.impl))) {
+        transport.free(transport.impl);
+        return NULL;
+    }
+
+    if (!(ctx = fw_init_transport("https", "funkwhale.test", transport))) {
+        view->free(view->impl);
+        return NULL;
+    }
+
+    fw_set_user_token(ctx, "TOKEN");
+
+    return ctx;
+}
+
+static size_t
+mem_count(fw_transport *view)
+{
+    const fw_mem_request *req;
+    size_t count = 0;
+
+    for (req = fw_mem_requests(view); req; req = req->next)
+        count++;
+
+    return count;
+}
+
+/*
+ * decode_result, for every listing
+ */
+typedef struct listing_case {
+    fw_request_type type;
+    const char *id;
+    const char *target;
+    const char *item; // JSON of the first result
+    size_t num;       // its first integer field
+    const char *str;  // its first string field, NULL if none
+} listing_case;
+
+static const listing_case listings[] = {
+    {FW_ARTISTS,   NULL, "/api/v1/artists",   "{\"id\":11,\"name\":\"Abba\"}", 11, "Abba"},
+    {FW_ALBUMS,    NULL, "/api/v1/albums",    "{\"id\":12,\"title\":\"Arrival\"}", 12, "Arrival"},
+    {FW_TRACKS,    NULL, "/api/v1/tracks",    "{\"id\":13,\"title\":\"Fernando\"}", 13, "Fernando"},
+    {FW_LIBRARIES, NULL, "/api/v1/libraries", "{\"uuid\":\"lib\",\"name\":\"Mine\",\"description\":\"d\"}", 0, "lib"},
+    {FW_UPLOADS,   NULL, "/api/v1/uploads",
+     "{\"uuid\":\"up\",\"filename\":\"a.mp3\",\"import_status\":\"finished\",\"track\":{\"id\":14},\"size\":2048}", 14, "up"},
+    {FW_CHANNELS,  NULL, "/api/v1/channels",
+     "{\"uuid\":\"ch\",\"actor\":{\"name\":\"Chan\",\"preferred_username\":\"chan\"}}", 0, "ch"},
+    {FW_FAVORITES, NULL, "/api/v1/favorites/tracks", "{\"id\":15,\"track\":{\"id\":16}}", 15, NULL},
+    {FW_FAVORITES_ALL, NULL, "/api/v1/favorites/tracks/all", "{\"id\":17,\"track\":18}", 17, NULL},
+    {FW_PLAYLISTS, NULL, "/api/v1/playlists",
+     "{\"id\":19,\"name\":\"Mix\",\"privacy_level\":\"me\",\"tracks_count\":3}", 19, "Mix"},
+    {FW_PLAYLIST_TRACKS, "19", "/api/v1/playlists/19/tracks",
+     "{\"index\":0,\"track\":{\"id\":20,\"title\":\"SOS\"}}", 0, "SOS"},
+    {FW_LISTENINGS, NULL, "/api/v1/history/listenings", "{\"id\":21,\"track\":{\"id\":22}}", 21, NULL},
+};
+
+static void
+listing_fields(fw_request_type type, const struct list *node, size_t *num, const char **str)
+{
+    *num = 0;
+    *str = NULL;
+
+    switch (type) {
+        case FW_ARTISTS:   *num = node->artist.id; *str = node->artist.name; break;
+        case FW_ALBUMS:    *num = node->album.id; *str = node->album.name; break;
+        case FW_TRACKS:    *num = node->track.id; *str = node->track.name; break;
+        case FW_LIBRARIES: *str = node->library.id; break;
+        case FW_UPLOADS:   *num = node->upload.track_id; *str = node->upload.id; break;
+        case FW_CHANNELS:  *str = node->channel.id; break;
+        case FW_FAVORITES:
+        case FW_FAVORITES_ALL: *num = node->favorite.id; break;
+        case FW_PLAYLISTS: *num = node->playlist.id; *str = node->playlist.name; break;
+        case FW_PLAYLIST_TRACKS: *num = node->playlist_track.index; *str = node->playlist_track.name; break;
+        case FW_LISTENINGS: *num = node->listening.id; break;
+        default: break;
+    }
+}
+
+static void
+test_listings(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(listings) / sizeof(*listings); ++i) {
+        const listing_case *c = &listings[i];
+        char body[1024];
+        fw_transport view;
+        funkctx *ctx = mem_ctx(&view);
+        const struct list *node;
+        fw_request_type type;
+        const char *str;
+        size_t num, count = 0;
+
+        if (!CHECK(ctx))
+            return;
+
+        snprintf(body, sizeof(body), "{\"next\":null,\"results\":[%s,%s]}", c->item, c->item);
+        fw_mem_respond(&view, "GET", c->target, 200, body);
+
+        if (CHECK(fw_request(ctx, c->type, c->id, NULL, NULL))) {
+            for (node = fw_results(ctx, &type); node; node = node->next)
+                count++;
+
+            node = fw_results(ctx, &type);
+            CHECK(type == c->type && count == 2);
+
+            if (node) {
+                listing_fields(c->type, node, &num, &str);
+                CHECK(num == c->num);
+                CHECK(c->str ? str && !strcmp(str, c->str) : !str);
+            }
+        }
+
+        fw_free(ctx);
+        view.free(view.impl);
+    }
+}
+
+static void
+test_objects(void)
+{
+    fw_transport view;
+    funkctx *ctx = mem_ctx(&view);
+    const struct list *node;
+
+    if (!CHECK(ctx))
+        return;
+
+    fw_mem_respond(&view, "GET", "/api/v1/uploads/up", 200,
+                   "{\"uuid\":\"up\",\"filename\":\"a.mp3\",\"import_status\":\"errored\",\"track\":null,\"size\":7}");
+
+    if (CHECK(fw_request(ctx, FW_UPLOAD, "up", NULL, NULL)) && CHECK((node = fw_results(ctx, NULL)))) {
+        CHECK(!strcmp(node->upload.status, "errored"));
+        CHECK(node->upload.size == 7 && !node->upload.track_id);
+        CHECK(!node->next);
+    }
+
+    fw_free(ctx);
+    view.free(view.impl);
+}
+
+/*
+ * Targets rendered from the endpoint table
+ */
+static void
+test_targets(void)
+{
+    static const struct {
+        fw_request_type type;
+        const char *method;
+        const char *path;
+        const char *query;
+        bool has_id;
+    } table[] = {
+#define X(type, method, path, query, has_id, ...) {type, method, path, query, has_id},
+        FW_ENDPOINTS(X)
+#undef X
+    };
+    fw_transport view;
+    funkctx *ctx = mem_ctx(&view);
+    size_t i;
+
+    if (!CHECK(ctx))
+        return;
+
+    for (i = 0; i < sizeof(table) / sizeof(*table); ++i) {
+        const fw_mem_request *req;
+        char target[1024];
+        size_t len;
+
+        // Nothing is canned, every request is answered 404
+        fw_mem_clear(&view);
+        CHECK(!fw_request(ctx, table[i].type, table[i].has_id ? "a b/c" : NULL, NULL, NULL));
+
+        len = snprintf(target, sizeof(target), table[i].path, "a%20b%2Fc");
+        if (*table[i].query)
+            snprintf(target + len, sizeof(target) - len, "?%s", table[i].query);
+
+        req = fw_mem_requests(&view);
+
+        if (CHECK(req && !req->next)) {
+            if (!check(!strcmp(req->method, table[i].method) && !strcmp(req->target, target), target, __LINE__))
+                fprintf(stderr, "    got %s %s\n", req->method, req->target);
+            CHECK(strstr(req->headers.data, "Authorization: Bearer TOKEN\r\n") != NULL);
+        }
+    }
+
+    // An extra query goes after the default one
+    fw_mem_clear(&view);
+    fw_get(ctx, FW_TRACKS, "s&p");
+    CHECK(mem_count(&view) == 1 && !strcmp(fw_mem_requests(&view)->target,
+          "/api/v1/tracks?ordering=title&page=1&page_size=10&content_category=music&q=s%26p"));
+
+    fw_free(ctx);
+    view.free(view.impl);
+}
+
+/*
+ * Multipart body of the attachments
+ */
+static void
+test_multipart(void)
+{
+    fw_transport view;
+    funkctx *ctx = mem_ctx(&view);
+    const fw_mem_request *req;
+    const char *boundary;
+    char delimiter[64], closing[64];
+    FILE *file = tmpfile();
+
+    if (!CHECK(ctx && file))
+        return;
+
+    fputs("JPEGDATA", file);
+    fflush(file);
+    rewind(file);
+
+    fw_mem_respond(&view, "POST", "/api/v1/attachments", 201, "{\"uuid\":\"att\",\"mimetype\":\"image/jpeg\"}");
+
+    CHECK(fw_attach(ctx, file, "image/jpeg"));
+    CHECK(fw_get_cover_id(ctx) && !strcmp(fw_get_cover_id(ctx), "att"));
+
+    req = fw_mem_requests(&view);
+
+    if (CHECK(req && !strcmp(req->method, "POST") && !strcmp(req->target, "/api/v1/attachments")) &&
+        CHECK((boundary = strstr(req->headers.data, "Content-Type: multipart/form-data; boundary=")))) {
+        boundary += strlen("Content-Type: multipart/form-data; boundary=");
+        snprintf(delimiter, sizeof(delimiter), "--%.*s\r\n", (int)strcspn(boundary, "\r"), boundary);
+        snprintf(closing, sizeof(closing), "\r\n--%.*s--\r\n", (int)strcspn(boundary, "\r"), boundary);
+
+        CHECK(!strncmp(req->body.data, delimiter, strlen(delimiter)));
+        CHECK(strstr(req->body.data, "Content-Disposition: form-data; name=\"file\"; filename=\"filename.jpg\"\r\n"));
+        CHECK(strstr(req->body.data, "Content-Length: 8\r\n\r\nJPEGDATA\r\n"));
+        CHECK(strstr(req->body.data, closing));
+    }
+
+    fclose(file);
+    fw_free(ctx);
+    view.free(view.impl);
+}
+
+/*
+ * Over-long ids and searches are refused before anything is sent
+ */
+static void
+test_long_ids(void)
+{
+    fw_transport view;
+    funkctx *ctx = mem_ctx(&view);
+    fw_upload_update update = {.upload_id = "up"};
+    char id[4*1024], enc[8];
+
+    if (!CHECK(ctx))
+        return;
+
+    memset(id, '/', sizeof(id) - 1);
+    id[sizeof(id) - 1] = '\0';
+
+    CHECK(url_encode_n("a b", enc, 6) && !strcmp(enc, "a%20b"));
+    CHECK(!url_encode_n("a b", enc, 5));
+
+    id[300] = '\0';
+    CHECK(!fw_request(ctx, FW_ARTIST, id, NULL, NULL));
+    CHECK(!strcmp(fw_error_str(ctx), "The request target is too long"));
+
+    id[300] = '/';
+    CHECK(!fw_get(ctx, FW_TRACKS, id));
+    CHECK(!strcmp(fw_error_str(ctx), "The search is too long"));
+
+    CHECK(!fw_update_uploads(ctx, id, &update, 1));
+    CHECK(update.status == FW_OP_FAILED);
+
+    CHECK(!fw_get_user_token(ctx, id));
+
+    CHECK(mem_count(&view) == 0);
+
+    // The longest id that fits still goes out
+    id[255] = '\0';
+    fw_request(ctx, FW_ARTIST, id, NULL, NULL);
+    CHECK(mem_count(&view) == 1);
+
+    fw_free(ctx);
+    view.free(view.impl);
+}
+
+int
+main(void)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+    url_enc_init();
+
+    test_listings();
+    test_objects();
+    test_targets();
+    test_multipart();
+    test_long_ids();
+
+    curl_global_cleanup();
+
+    if (failures) {
+        fprintf(stderr, "%d failed\n", failures);
+        return 1;
+    }
+
+    puts("All tests passed");
+
+    return 0;
+}
@@ -0,0 +1,1361 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+
+#include "transport.h"
+
+#define UNUSED(var) do {(void)var;} while (0)
+
+#define CONNECT_TIMEOUT_MS (10*1000L)
+
+// TLS sessions can only be carried over since curl 8.12
+#if LIBCURL_VERSION_NUM >= 0x080c00
+#define CACHE_SESSIONS 1
+#endif
+
+static long long
+monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// ``timeout_ms`` from now, 0 means no deadline
+void
+fw_cancel_init(fw_cancel *cancel, long timeout_ms, const fw_cancel *parent)
+{
+    atomic_init(&cancel->cancelled, false);
+    cancel->deadline_ms = timeout_ms ? monotonic_ms() + timeout_ms : 0;
+    cancel->parent = parent;
+}
+
+void
+fw_cancel_trigger(fw_cancel *cancel)
+{
+    atomic_store(&cancel->cancelled, true);
+}
+
+bool
+fw_cancelled(const fw_cancel *cancel)
+{
+    long long now = 0;
+
+    for (; cancel; cancel = cancel->parent) {
+        if (atomic_load(&cancel->cancelled))
+            return true;
+
+        if (cancel->deadline_ms && cancel->deadline_ms <= (now ? now : (now = monotonic_ms())))
+            return true;
+    }
+
+    return false;
+}
+
+// Why the requests are cancelled, NULL if they aren't
+const char*
+fw_cancel_reason(const fw_cancel *cancel)
+{
+    const fw_cancel *c;
+
+    if (!fw_cancelled(cancel))
+        return NULL;
+
+    for (c = cancel; c; c = c->parent)
+        if (atomic_load(&c->cancelled))
+            return "Cancelled";
+
+    return "Deadline exceeded";
+}
+
+// Time left before the nearest deadline, -1 if there is none
+long
+fw_cancel_left_ms(const fw_cancel *cancel)
+{
+    long long now = monotonic_ms(), left = -1;
+
+    for (; cancel; cancel = cancel->parent)
+        if (cancel->deadline_ms && (left < 0 || cancel->deadline_ms - now < left))
+            left = cancel->deadline_ms - now > 0 ? cancel->deadline_ms - now : 0;
+
+    return left;
+}
+
+bool
+buf_append(fw_buf *buf, const void *data, size_t size)
+{
+    if (buf->size + size + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 1024;
+        char *new_data;
+
+        while (cap < buf->size + size + 1)
+            cap *= 2;
+
+        if (!(new_data = realloc(buf->data, cap)))
+            return false;
+
+        buf->data = new_data;
+        buf->cap = cap;
+    }
+
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    buf->data[buf->size] = '\0';
+
+    return true;
+}
+
+void
+buf_free(fw_buf *buf)
+{
+    free(buf->data);
+    *buf = (fw_buf){0};
+}
+
+const char*
+fw_response_header(const fw_http_response *resp, const char *name, char *value, size_t size)
+{
+    const char *line = resp->headers.data;
+    const char *found = NULL;
+    size_t len = strlen(name);
+    size_t value_len = 0;
+
+    // The last one wins, there are several responses if redirects were followed
+    for (; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (strncasecmp(line, name, len) || line[len] != ':')
+            continue;
+
+        for (found = line + len + 1; *found == ' ' || *found == '\t'; ++found);
+        for (value_len = 0; found[value_len] && found[value_len] != '\r' && found[value_len] != '\n'; ++value_len);
+    }
+
+    if (!found || !size)
+        return NULL;
+
+    if (value_len >= size)
+        value_len = size - 1;
+
+    memcpy(value, found, value_len);
+    value[value_len] = '\0';
+
+    return value;
+}
+
+void
+fw_response_free(fw_http_response *resp)
+{
+    buf_free(&resp->headers);
+    buf_free(&resp->body);
+}
+
+/*
+ * Connection cache
+ *
+ * What makes the next connection cheaper survives the process: TLS sessions
+ * in ``path``, HSTS and Alt-Svc in curl's own files next to it. The file also
+ * keeps the time of a full handshake, so a start that resumes a session can
+ * tell how much it saved.
+ */
+typedef struct conn_cache {
+    pthread_mutex_t lock;
+    pthread_mutex_t data_lock[CURL_LOCK_DATA_LAST];
+    size_t refs;
+    CURLSH *share;
+    bool loaded;
+    size_t sessions; // imported from the file
+
+    char path[4096];
+    char hsts[4096 + 8];
+    char altsvc[4096 + 8];
+
+    long long baseline_us; // a full handshake, 0 if none was seen yet
+    long long handshake_us;
+    long long saved_us;
+} conn_cache;
+
+static void
+cache_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *arg)
+{
+    conn_cache *c = arg;
+
+    UNUSED(curl);
+    UNUSED(access);
+
+    pthread_mutex_lock(&c->data_lock[data]);
+}
+
+static void
+cache_unlock(CURL *curl, curl_lock_data data, void *arg)
+{
+    conn_cache *c = arg;
+
+    UNUSED(curl);
+
+    pthread_mutex_unlock(&c->data_lock[data]);
+}
+
+static conn_cache*
+cache_open(const char *path)
+{
+    conn_cache *c;
+    int i;
+
+    if (!path || !(c = calloc(sizeof(*c), 1))) // Don't forget to free
+        return NULL;
+
+    if (!(c->share = curl_share_init())) {
+        free(c);
+        return NULL;
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init(&c->data_lock[i], NULL);
+
+    c->refs = 1;
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    snprintf(c->hsts, sizeof(c->hsts), "%s.hsts", path);
+    snprintf(c->altsvc, sizeof(c->altsvc), "%s.altsvc", path);
+
+    curl_share_setopt(c->share, CURLSHOPT_LOCKFUNC, cache_lock);
+    curl_share_setopt(c->share, CURLSHOPT_UNLOCKFUNC, cache_unlock);
+    curl_share_setopt(c->share, CURLSHOPT_USERDATA, c);
+    curl_share_setopt(c->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(c->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+#if LIBCURL_VERSION_NUM >= 0x075800
+    curl_share_setopt(c->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_HSTS);
+#endif
+
+    return c;
+}
+
+#ifdef CACHE_SESSIONS
+static void
+hex_put(FILE *file, const unsigned char *data, size_t size)
+{
+    if (!size)
+        fputc('-', file);
+
+    while (size--)
+        fprintf(file, "%02x", *data++);
+}
+
+// Decodes in place, the result is NUL-terminated
+static size_t
+hex_get(char *hex)
+{
+    unsigned char *out = (unsigned char*)hex;
+    unsigned int byte;
+    size_t n = 0;
+
+    if (!strcmp(hex, "-"))
+        hex += 1;
+
+    for (; isxdigit(hex[0]) && isxdigit(hex[1]) && sscanf(hex, "%2x", &byte) == 1; hex += 2)
+        out[n++] = byte;
+
+    out[n] = '\0';
+
+    return n;
+}
+
+// S <valid until> <key> <shmac> <session data>, all but the first in hex
+static void
+cache_import(conn_cache *c, CURL *curl, char *line)
+{
+    char *save, *until, *key, *shmac, *sdata;
+    size_t shmac_len, sdata_len;
+
+    until = strtok_r(line, " \n", &save);
+    key = strtok_r(NULL, " \n", &save);
+    shmac = strtok_r(NULL, " \n", &save);
+    sdata = strtok_r(NULL, " \n", &save);
+
+    if (!sdata || strtoll(until, NULL, 10) < (long long)time(NULL))
+        return;
+
+    hex_get(key);
+    shmac_len = hex_get(shmac);
+    sdata_len = hex_get(sdata);
+
+    if (curl_easy_ssls_import(curl, *key ? key : NULL, (unsigned char*)shmac, shmac_len, (unsigned char*)sdata, sdata_len) == CURLE_OK)
+        c->sessions++;
+}
+
+static CURLcode
+cache_export(CURL *curl, void *arg, const char *key, const unsigned char *shmac, size_t shmac_len,
+             const unsigned char *sdata, size_t sdata_len, curl_off_t valid_until,
+             int tls_id, const char *alpn, size_t earlydata_max)
+{
+    FILE *file = arg;
+
+    UNUSED(curl);
+    UNUSED(tls_id);
+    UNUSED(alpn);
+    UNUSED(earlydata_max);
+
+    fprintf(file, "S %lld ", (long long)valid_until);
+    hex_put(file, (const unsigned char*)key, key ? strlen(key) : 0);
+    fputc(' ', file);
+    hex_put(file, shmac, shmac_len);
+    fputc(' ', file);
+    hex_put(file, sdata, sdata_len);
+    fputc('\n', file);
+
+    return CURLE_OK;
+}
+#endif
+
+static void
+cache_load(conn_cache *c, CURL *curl)
+{
+    FILE *file = fopen(c->path, "r"); // Don't forget to close
+    char *line = NULL;
+    size_t cap = 0;
+
+    UNUSED(curl);
+
+    if (!file)
+        return;
+
+    while (getline(&line, &cap, file) > 0) {
+        if (line[0] == 'H')
+            sscanf(line, "H %lld", &c->baseline_us);
+#ifdef CACHE_SESSIONS
+        else if (line[0] == 'S')
+            cache_import(c, curl, line + 2);
+#endif
+    }
+
+    free(line);
+    fclose(file);
+}
+
+// Written aside and renamed, the sessions are secrets and readers never see a half
+static void
+cache_save(conn_cache *c)
+{
+    char tmp[sizeof(c->path) + 32];
+    FILE *file;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.%ld", c->path, (long)getpid());
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return;
+
+    if (!(file = fdopen(fd, "w"))) {
+        close(fd);
+        remove(tmp);
+        return;
+    }
+
+    fprintf(file, "H %lld\n", c->baseline_us);
+
+#ifdef CACHE_SESSIONS
+    {
+        CURL *curl = curl_easy_init();
+
+        if (curl) {
+            curl_easy_setopt(curl, CURLOPT_SHARE, c->share);
+            curl_easy_ssls_export(curl, cache_export, file);
+            curl_easy_cleanup(curl);
+        }
+    }
+#endif
+
+    if (fclose(file) || rename(tmp, c->path))
+        remove(tmp);
+}
+
+static void
+cache_attach(conn_cache *c, CURL *curl)
+{
+    bool first;
+
+    curl_easy_setopt(curl, CURLOPT_SHARE, c->share);
+    curl_easy_setopt(curl, CURLOPT_HSTS_CTRL, (long)CURLHSTS_ENABLE);
+    curl_easy_setopt(curl, CURLOPT_HSTS, c->hsts);
+    curl_easy_setopt(curl, CURLOPT_ALTSVC_CTRL, (long)(CURLALTSVC_H1 | CURLALTSVC_H2 | CURLALTSVC_H3));
+    curl_easy_setopt(curl, CURLOPT_ALTSVC, c->altsvc);
+
+    pthread_mutex_lock(&c->lock);
+    first = !c->loaded;
+    c->loaded = true;
+    pthread_mutex_unlock(&c->lock);
+
+    // The sessions go into the share, so one handle is enough
+    if (first)
+        cache_load(c, curl);
+}
+
+// Called after the first transfer of the transport
+static void
+cache_measure(conn_cache *c, CURL *curl)
+{
+    curl_off_t connect = 0, app = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &app);
+
+    // Plain HTTP or a reused connection
+    if (app <= connect)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+
+    c->handshake_us = app - connect;
+
+    // Nothing to resume from, so that was a full one
+    if (!c->sessions || !c->baseline_us)
+        c->baseline_us = c->handshake_us;
+    else if (c->baseline_us > c->handshake_us)
+        c->saved_us = c->baseline_us - c->handshake_us;
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+static bool
+cache_stats(conn_cache *c, long *handshake_us, long *saved_us)
+{
+    if (!c)
+        return false;
+
+    pthread_mutex_lock(&c->lock);
+    *handshake_us = c->handshake_us;
+    *saved_us = c->saved_us;
+    pthread_mutex_unlock(&c->lock);
+
+    return true;
+}
+
+static conn_cache*
+cache_ref(conn_cache *c)
+{
+    if (c) {
+        pthread_mutex_lock(&c->lock);
+        c->refs++;
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    return c;
+}
+
+// The handles using it must be gone, curl writes HSTS and Alt-Svc on cleanup
+static void
+cache_unref(conn_cache *c)
+{
+    bool last;
+    int i;
+
+    if (!c)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+    last = !--c->refs;
+    pthread_mutex_unlock(&c->lock);
+
+    if (!last)
+        return;
+
+    // Never attached, saving it would wipe the file with nothing
+    if (c->loaded)
+        cache_save(c);
+
+    curl_share_cleanup(c->share);
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_destroy(&c->data_lock[i]);
+
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+/*
+ * curl transport
+ */
+typedef struct curl_transport {
+    CURL *curl;
+    conn_cache *cache;
+    char scheme[16];
+    char server[256];
+} curl_transport;
+
+static size_t
+buf_write(char *data, size_t size, size_t nmemb, void *arg)
+{
+    return buf_append(arg, data, size * nmemb) ? size * nmemb : 0;
+}
+
+static size_t
+discard(char *data, size_t size, size_t nmemb, void *arg)
+{
+    UNUSED(data);
+    UNUSED(arg);
+
+    return size * nmemb;
+}
+
+static int
+cancel_progress(void *arg, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    UNUSED(dltotal);
+    UNUSED(dlnow);
+    UNUSED(ultotal);
+    UNUSED(ulnow);
+
+    return fw_cancelled(arg);
+}
+
+static CURL*
+curl_open(const char *scheme, const char *server, conn_cache *cache)
+{
+    CURL *curl = curl_easy_init();
+
+    if (!curl)
+        return NULL;
+
+    if (cache)
+        cache_attach(cache, curl);
+
+    // Both are copied by curl
+    curl_easy_setopt(curl, CURLOPT_DEFAULT_PROTOCOL, scheme);
+    curl_easy_setopt(curl, CURLOPT_URL, server);
+    //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(curl, CURLOPT_UNRESTRICTED_AUTH, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_AUTOREFERER, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, cancel_progress);
+    // A server that doesn't answer at all, whatever the request timeouts
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, CONNECT_TIMEOUT_MS);
+
+    return curl;
+}
+
+static curl_transport*
+curl_transport_open(const char *scheme, const char *server, conn_cache *cache)
+{
+    curl_transport *t = calloc(sizeof(*t), 1); // Don't forget to free
+
+    if (!t)
+        return NULL;
+
+    snprintf(t->scheme, sizeof(t->scheme), "%s", scheme);
+    snprintf(t->server, sizeof(t->server), "%s", server);
+
+    if (!(t->curl = curl_open(t->scheme, t->server, cache))) {
+        free(t);
+        return NULL;
+    }
+
+    t->cache = cache_ref(cache);
+
+    return t;
+}
+
+static void
+curl_setup(CURL *curl, const fw_http_request *req, fw_http_response *resp)
+{
+    bool get = !strcmp(req->method, "GET");
+    long timeout_ms = req->timeout_ms;
+    long left = fw_cancel_left_ms(req->cancel);
+
+    // curl takes 0 as no timeout
+    if (left >= 0 && (!timeout_ms || left < timeout_ms))
+        timeout_ms = left ? left : 1;
+
+    if (get) {
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    }
+    else if (req->body_file) {
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, NULL); // fread
+        curl_easy_setopt(curl, CURLOPT_READDATA, req->body_file);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req->body_size);
+    }
+    else {
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req->body_size);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body ? req->body : "");
+    }
+
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, get || !strcmp(req->method, "POST") ? NULL : req->method);
+    curl_easy_setopt(curl, CURLOPT_REQUEST_TARGET, req->target);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buf_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp->body);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, buf_write);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &resp->headers);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, resp->error);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, req->cancel ? 0L : 1L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, req->cancel);
+
+    *resp->error = '\0';
+}
+
+static bool
+curl_done(CURL *curl, CURLcode rc, fw_http_response *resp)
+{
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->status);
+
+    // Nothing of the request outlives the call
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(curl, CURLOPT_READDATA, NULL);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, NULL);
+
+    if (rc == CURLE_ABORTED_BY_CALLBACK)
+        snprintf(resp->error, sizeof(resp->error), "Cancelled");
+    else if (rc != CURLE_OK && !*resp->error)
+        snprintf(resp->error, sizeof(resp->error), "%s", curl_easy_strerror(rc));
+
+    return rc == CURLE_OK;
+}
+
+static bool
+curl_transport_send(void *impl, const fw_http_request *req, fw_http_response *resp)
+{
+    curl_transport *t = impl;
+
+    curl_setup(t->curl, req, resp);
+
+    return curl_done(t->curl, curl_easy_perform(t->curl), resp);
+}
+
+static void
+curl_transport_free(void *impl)
+{
+    curl_transport *t = impl;
+
+    curl_easy_cleanup(t->curl);
+    cache_unref(t->cache);
+    free(t);
+}
+
+static void*
+curl_transport_dup(void *impl)
+{
+    curl_transport *t = impl;
+
+    return curl_transport_open(t->scheme, t->server, t->cache);
+}
+
+static bool
+curl_transport_stats(void *impl, long *handshake_us, long *saved_us)
+{
+    return cache_stats(((curl_transport*)impl)->cache, handshake_us, saved_us);
+}
+
+bool
+fw_curl_transport_cached(fw_transport *transport, const char *scheme, const char *server, const char *cache_path)
+{
+    conn_cache *cache = cache_open(cache_path);
+    curl_transport *t = curl_transport_open(scheme, server, cache);
+
+    // The transport holds its own reference
+    cache_unref(cache);
+
+    if (!t)
+        return false;
+
+    // Warm the connection up, so the first real request doesn't pay for it
+    if (curl_easy_perform(t->curl) != CURLE_OK) {
+        curl_transport_free(t);
+        return false;
+    }
+
+    if (t->cache)
+        cache_measure(t->cache, t->curl);
+
+    *transport = (fw_transport){
+        .impl = t,
+        .send = curl_transport_send,
+        .dup = curl_transport_dup,
+        .free = curl_transport_free,
+        .stats = curl_transport_stats,
+    };
+
+    return true;
+}
+
+bool
+fw_curl_transport(fw_transport *transport, const char *scheme, const char *server)
+{
+    return fw_curl_transport_cached(transport, scheme, server, NULL);
+}
+
+/*
+ * Scheduled curl transport
+ *
+ * One engine thread drives every transfer on a curl multi handle, so the
+ * copies share the connections and a large upload doesn't hold the others
+ * back. Waiting requests are admitted by class: interactive first, bulk
+ * never takes the last free slot unless it's the only one, and bulk transfers
+ * are slowed down to the yield rates for as long as interactive requests are
+ * in flight.
+ *
+ * In HTTP/2 mode the transfers are streams multiplexed over one connection to
+ * the server, which gets the class as a stream weight too. Without HTTP/2 on
+ * either end it falls back to the connections of HTTP/1.1.
+ */
+typedef struct sched_job {
+    const fw_http_request *req;
+    fw_http_response *resp;
+    CURL *curl;
+    bool done;
+    bool ok;
+    struct sched_job *next;
+} sched_job;
+
+typedef struct sched_transport {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pthread_t engine;
+    bool stop;
+    size_t refs;
+
+    CURLM *multi;
+    conn_cache *cache;
+    bool measured;
+    char scheme[16];
+    char server[256];
+    fw_sched_opts opts;
+
+    sched_job *waiting[FW_PRIO_COUNT];
+    sched_job **last[FW_PRIO_COUNT];
+    sched_job *running; // running jobs in any class
+    size_t active[FW_PRIO_COUNT];
+    bool yielding;
+
+    CURL *idle[8]; // finished handles kept for reuse
+    size_t nidle;
+} sched_transport;
+
+static const fw_sched_opts sched_defaults = {
+    .max_active = 6,
+    .max_bulk = 1,
+    .max_streams = 100,
+};
+
+// HTTP/2 stream weights by class, 1 to 256
+static const long sched_weights[FW_PRIO_COUNT] = {256, 64, 8};
+
+static int
+sched_priority(const fw_http_request *req)
+{
+    return req->priority < 0 ? 0 : req->priority >= FW_PRIO_COUNT ? FW_PRIO_COUNT - 1 : req->priority;
+}
+
+static void
+sched_shape(sched_transport *t, CURL *curl)
+{
+    curl_off_t send = t->yielding && t->opts.yield_send_rate ? t->opts.yield_send_rate : t->opts.bulk_send_rate;
+    curl_off_t recv = t->yielding && t->opts.yield_recv_rate ? t->opts.yield_recv_rate : t->opts.bulk_recv_rate;
+
+    curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, send);
+    curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, recv);
+}
+
+static void
+sched_stream(sched_transport *t, CURL *curl, const fw_http_request *req)
+{
+    if (!t->opts.http2)
+        return;
+
+    // Without TLS there is nothing to negotiate it with
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, strcmp(t->scheme, "http") ?
+                     CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+    // Wait for the connection to be up rather than open another one, unless
+    // the request is meant to get around a stalled one
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, req->fresh_connection ? 0L : 1L);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, req->fresh_connection ? 1L : 0L);
+    curl_easy_setopt(curl, CURLOPT_STREAM_WEIGHT, sched_weights[sched_priority(req)]);
+}
+
+// Early data can be replayed by anyone on the way, so only GETs send it. The
+// option is part of what curl matches connections on, so they get
+// connections of their own and the other requests never go out as 0-RTT.
+static void
+sched_early(sched_transport *t, CURL *curl, const fw_http_request *req)
+{
+#ifdef CURLSSLOPT_EARLYDATA
+    curl_easy_setopt(curl, CURLOPT_SSL_OPTIONS,
+                     t->opts.early_data && !strcmp(req->method, "GET") ? (long)CURLSSLOPT_EARLYDATA : 0L);
+#else
+    UNUSED(t);
+    UNUSED(curl);
+    UNUSED(req);
+#endif
+}
+
+// Called with the lock held
+static void
+sched_admit(sched_transport *t)
+{
+    size_t total = t->active[FW_PRIO_INTERACTIVE] + t->active[FW_PRIO_BACKGROUND] + t->active[FW_PRIO_BULK];
+    bool yielding;
+    sched_job *job;
+    int prio;
+
+    for (prio = 0; prio < FW_PRIO_COUNT; ++prio) {
+        while ((job = t->waiting[prio]) && total < t->opts.max_active) {
+            // Keep a slot free for interactive requests, if there is more than one
+            if (prio == FW_PRIO_BULK && (t->active[prio] >= t->opts.max_bulk ||
+                                         (t->opts.max_active > 1 && total + 1 >= t->opts.max_active)))
+                break;
+
+            if (!(job->curl = t->nidle ? t->idle[--t->nidle] : curl_open(t->scheme, t->server, t->cache)))
+                break;
+
+            if (!(t->waiting[prio] = job->next))
+                t->last[prio] = &t->waiting[prio];
+
+            curl_setup(job->curl, job->req, job->resp);
+            curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+            sched_stream(t, job->curl, job->req);
+            sched_early(t, job->curl, job->req);
+
+            if (prio == FW_PRIO_BULK)
+                sched_shape(t, job->curl);
+
+            if (curl_multi_add_handle(t->multi, job->curl) != CURLM_OK) {
+                curl_done(job->curl, CURLE_FAILED_INIT, job->resp);
+                curl_easy_cleanup(job->curl);
+                job->done = true;
+                pthread_cond_broadcast(&t->done);
+                continue;
+            }
+
+            job->next = t->running;
+            t->running = job;
+            t->active[prio]++;
+            total++;
+        }
+    }
+
+    // Bulk transfers yield while there is anything interactive to do
+    yielding = t->active[FW_PRIO_INTERACTIVE] || t->waiting[FW_PRIO_INTERACTIVE];
+
+    if (yielding != t->yielding) {
+        t->yielding = yielding;
+
+        for (job = t->running; job; job = job->next)
+            if (sched_priority(job->req) == FW_PRIO_BULK)
+                sched_shape(t, job->curl);
+    }
+}
+
+// Called with the lock held
+static void
+sched_finish(sched_transport *t, sched_job *job, CURLcode rc)
+{
+    sched_job **p;
+
+    for (p = &t->running; *p != job; p = &(*p)->next);
+    *p = job->next;
+    t->active[sched_priority(job->req)]--;
+
+    curl_multi_remove_handle(t->multi, job->curl);
+    job->ok = curl_done(job->curl, rc, job->resp);
+
+    // The first one is the warm-up
+    if (t->cache && !t->measured) {
+        cache_measure(t->cache, job->curl);
+        t->measured = true;
+    }
+
+    // Reset the per-request state, the connections stay with the multi handle
+    curl_easy_setopt(job->curl, CURLOPT_MAX_SEND_SPEED_LARGE, (curl_off_t)0);
+    curl_easy_setopt(job->curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)0);
+
+    if (t->nidle < sizeof(t->idle) / sizeof(*t->idle))
+        t->idle[t->nidle++] = job->curl;
+    else
+        curl_easy_cleanup(job->curl);
+
+    job->done = true;
+    pthread_cond_broadcast(&t->done);
+}
+
+// Drops the cancelled jobs, called with the lock held
+static void
+sched_sweep(sched_transport *t)
+{
+    sched_job **p, *job, *next;
+    int prio;
+
+    for (prio = 0; prio < FW_PRIO_COUNT; ++prio) {
+        for (p = &t->waiting[prio]; (job = *p);) {
+            if (!fw_cancelled(job->req->cancel)) {
+                p = &job->next;
+                continue;
+            }
+
+            if (!(*p = job->next))
+                t->last[prio] = p;
+
+            snprintf(job->resp->error, sizeof(job->resp->error), "%s", fw_cancel_reason(job->req->cancel));
+            job->done = true;
+            pthread_cond_broadcast(&t->done);
+        }
+    }
+
+    for (job = t->running; job; job = next) {
+        next = job->next;
+
+        if (fw_cancelled(job->req->cancel)) {
+            sched_finish(t, job, CURLE_ABORTED_BY_CALLBACK);
+            snprintf(job->resp->error, sizeof(job->resp->error), "%s", fw_cancel_reason(job->req->cancel));
+        }
+    }
+}
+
+static void*
+sched_engine(void *arg)
+{
+    sched_transport *t = arg;
+    CURLMsg *msg;
+    int running, left;
+
+    pthread_mutex_lock(&t->lock);
+
+    while (!t->stop) {
+        sched_admit(t);
+        pthread_mutex_unlock(&t->lock);
+
+        curl_multi_perform(t->multi, &running);
+
+        pthread_mutex_lock(&t->lock);
+        while ((msg = curl_multi_info_read(t->multi, &left))) {
+            sched_job *job;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&job);
+            sched_finish(t, job, msg->data.result);
+        }
+
+        if (t->stop)
+            break;
+
+        sched_sweep(t);
+        sched_admit(t);
+        pthread_mutex_unlock(&t->lock);
+
+        // Woken up by new requests
+        curl_multi_poll(t->multi, NULL, 0, 1000, NULL);
+
+        pthread_mutex_lock(&t->lock);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+static bool
+sched_send(void *impl, const fw_http_request *req, fw_http_response *resp)
+{
+    sched_transport *t = impl;
+    sched_job job = {.req = req, .resp = resp};
+    int prio = sched_priority(req);
+
+    pthread_mutex_lock(&t->lock);
+
+    *t->last[prio] = &job;
+    t->last[prio] = &job.next;
+
+    curl_multi_wakeup(t->multi);
+
+    while (!job.done) {
+        struct timespec at;
+
+        if (!req->cancel) {
+            pthread_cond_wait(&t->done, &t->lock);
+            continue;
+        }
+
+        // The engine is told as soon as it's cancelled, it doesn't look by itself
+        clock_gettime(CLOCK_REALTIME, &at);
+        at.tv_nsec += 20*1000000;
+        if (at.tv_nsec >= 1000000000) {
+            at.tv_sec++;
+            at.tv_nsec -= 1000000000;
+        }
+
+        if (pthread_cond_timedwait(&t->done, &t->lock, &at) == ETIMEDOUT && fw_cancelled(req->cancel))
+            curl_multi_wakeup(t->multi);
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return job.ok;
+}
+
+static void
+sched_free(void *impl)
+{
+    sched_transport *t = impl;
+    bool last;
+
+    pthread_mutex_lock(&t->lock);
+    last = !--t->refs;
+    t->stop = last;
+    pthread_mutex_unlock(&t->lock);
+
+    if (!last)
+        return;
+
+    // Nobody can be waiting on the last reference
+    curl_multi_wakeup(t->multi);
+    pthread_join(t->engine, NULL);
+
+    while (t->nidle)
+        curl_easy_cleanup(t->idle[--t->nidle]);
+
+    curl_multi_cleanup(t->multi);
+    cache_unref(t->cache);
+    pthread_cond_destroy(&t->done);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+static void*
+sched_dup(void *impl)
+{
+    sched_transport *t = impl;
+
+    // The engine serves any number of threads
+    pthread_mutex_lock(&t->lock);
+    t->refs++;
+    pthread_mutex_unlock(&t->lock);
+
+    return t;
+}
+
+static bool
+sched_stats(void *impl, long *handshake_us, long *saved_us)
+{
+    return cache_stats(((sched_transport*)impl)->cache, handshake_us, saved_us);
+}
+
+bool
+fw_sched_transport(fw_transport *transport, const char *scheme, const char *server, const fw_sched_opts *opts)
+{
+    sched_transport *t = calloc(sizeof(*t), 1); // Don't forget to free
+    fw_http_request probe = {.method = "GET", .target = "/", .priority = FW_PRIO_INTERACTIVE};
+    fw_http_response resp = {0};
+    int prio;
+    bool ok;
+
+    if (!t)
+        return false;
+
+    if (!(t->multi = curl_multi_init())) {
+        free(t);
+        return false;
+    }
+
+    if (opts)
+        t->cache = cache_open(opts->cache_path);
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->done, NULL);
+    t->refs = 1;
+    snprintf(t->scheme, sizeof(t->scheme), "%s", scheme);
+    snprintf(t->server, sizeof(t->server), "%s", server);
+
+    t->opts = opts ? *opts : sched_defaults;
+
+    // Before curl 8 the streams after the first one of a cleartext HTTP/2
+    // connection fail with a framing error, so it stays on HTTP/1.1
+    if (t->opts.http2 && !strcmp(scheme, "http") && curl_version_info(CURLVERSION_NOW)->version_num < 0x080000)
+        t->opts.http2 = false;
+
+    if (!t->opts.max_streams)
+        t->opts.max_streams = sched_defaults.max_streams;
+    if (!t->opts.max_active)
+        t->opts.max_active = t->opts.http2 ? t->opts.max_streams : sched_defaults.max_active;
+    if (!t->opts.max_bulk)
+        t->opts.max_bulk = sched_defaults.max_bulk;
+
+    if (t->opts.http2) {
+        curl_multi_setopt(t->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+        curl_multi_setopt(t->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)t->opts.max_streams);
+#endif
+    }
+
+    for (prio = 0; prio < FW_PRIO_COUNT; ++prio)
+        t->last[prio] = &t->waiting[prio];
+
+    if (pthread_create(&t->engine, NULL, sched_engine, t)) {
+        curl_multi_cleanup(t->multi);
+        cache_unref(t->cache);
+        pthread_cond_destroy(&t->done);
+        pthread_mutex_destroy(&t->lock);
+        free(t);
+        return false;
+    }
+
+    // Warm the connection up, so the first real request doesn't pay for it
+    ok = sched_send(t, &probe, &resp);
+    fw_response_free(&resp);
+
+    if (!ok) {
+        sched_free(t);
+        return false;
+    }
+
+    *transport = (fw_transport){
+        .impl = t,
+        .send = sched_send,
+        .dup = sched_dup,
+        .free = sched_free,
+        .stats = sched_stats,
+    };
+
+    return true;
+}
+
+bool
+fw_transport_stats(const fw_transport *transport, long *handshake_us, long *saved_us)
+{
+    return transport->stats && transport->stats(transport->impl, handshake_us, saved_us);
+}
+
+/*
+ * In-memory transport
+ *
+ * Serves canned responses and captures the requests without any I/O, so the
+ * library can be tested and measured on its own.
+ */
+typedef struct mem_response {
+    char *method; // NULL matches any method
+    char *target; // the path only matches any query
+    long status;
+    char *body;
+    struct mem_response *next;
+} mem_response;
+
+typedef struct mem_transport {
+    pthread_mutex_t lock;
+    size_t refs;
+
+    mem_response *responses;
+    fw_mem_request *requests;
+    fw_mem_request **last;
+} mem_transport;
+
+static bool
+mem_match(const mem_response *canned, const fw_http_request *req)
+{
+    size_t len = strlen(canned->target);
+
+    if (canned->method && strcmp(canned->method, req->method))
+        return false;
+
+    return !strncmp(canned->target, req->target, len)
+        && (req->target[len] == '\0' || (req->target[len] == '?' && !strchr(canned->target, '?')));
+}
+
+static bool
+mem_send(void *impl, const fw_http_request *req, fw_http_response *resp)
+{
+    mem_transport *t = impl;
+    fw_mem_request *captured = calloc(sizeof(*captured), 1); // Freed with the transport
+    const struct curl_slist *header;
+    const mem_response *canned;
+    bool ok = true;
+
+    if (!captured)
+        return false;
+
+    if (fw_cancelled(req->cancel)) {
+        snprintf(resp->error, sizeof(resp->error), "%s", fw_cancel_reason(req->cancel));
+        free(captured);
+        return false;
+    }
+
+    captured->method = strdup(req->method);
+    captured->target = strdup(req->target);
+
+    for (header = req->headers; header; header = header->next) {
+        buf_append(&captured->headers, header->data, strlen(header->data));
+        buf_append(&captured->headers, "\r\n", 2);
+    }
+
+    if (req->body_file) {
+        char chunk[16*1024];
+        size_t n, left = req->body_size;
+
+        while (left && (n = fread(chunk, 1, left < sizeof(chunk) ? left : sizeof(chunk), req->body_file)) > 0) {
+            buf_append(&captured->body, chunk, n);
+            left -= n;
+        }
+    }
+    else if (req->body) {
+        buf_append(&captured->body, req->body, req->body_size);
+    }
+
+    pthread_mutex_lock(&t->lock);
+
+    *t->last = captured;
+    t->last = &captured->next;
+
+    for (canned = t->responses; canned && !mem_match(canned, req); canned = canned->next);
+
+    resp->status = canned ? canned->status : 404;
+
+    if (canned && canned->body)
+        ok = buf_append(&resp->body, canned->body, strlen(canned->body));
+
+    pthread_mutex_unlock(&t->lock);
+
+    return ok;
+}
+
+static void
+mem_clear(mem_transport *t)
+{
+    fw_mem_request *req, *next;
+
+    for (req = t->requests; req; req = next) {
+        next = req->next;
+
+        free(req->method);
+        free(req->target);
+        buf_free(&req->headers);
+        buf_free(&req->body);
+        free(req);
+    }
+
+    t->requests = NULL;
+    t->last = &t->requests;
+}
+
+static void
+mem_free(void *impl)
+{
+    mem_transport *t = impl;
+    mem_response *canned, *next;
+    bool last;
+
+    pthread_mutex_lock(&t->lock);
+    last = !--t->refs;
+    pthread_mutex_unlock(&t->lock);
+
+    if (!last)
+        return;
+
+    for (canned = t->responses; canned; canned = next) {
+        next = canned->next;
+
+        free(canned->method);
+        free(canned->target);
+        free(canned->body);
+        free(canned);
+    }
+
+    mem_clear(t);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+static void*
+mem_dup(void *impl)
+{
+    mem_transport *t = impl;
+
+    // All the copies share the responses and the captured requests
+    pthread_mutex_lock(&t->lock);
+    t->refs++;
+    pthread_mutex_unlock(&t->lock);
+
+    return t;
+}
+
+bool
+fw_mem_transport(fw_transport *transport)
+{
+    mem_transport *t = calloc(sizeof(*t), 1); // Don't forget to free
+
+    if (!t)
+        return false;
+
+    pthread_mutex_init(&t->lock, NULL);
+    t->refs = 1;
+    t->last = &t->requests;
+
+    *transport = (fw_transport){
+        .impl = t,
+        .send = mem_send,
+        .dup = mem_dup,
+        .free = mem_free,
+    };
+
+    return true;
+}
+
+bool
+fw_mem_respond(fw_transport *transport, const char *method, const char *target, long status, const char *body)
+{
+    mem_transport *t = transport->impl;
+    mem_response *canned = calloc(sizeof(*canned), 1);
+    mem_response **last;
+
+    if (!canned)
+        return false;
+
+    canned->method = method ? strdup(method) : NULL;
+    canned->target = strdup(target);
+    canned->status = status;
+    canned->body = body ? strdup(body) : NULL;
+
+    // First added is first matched
+    pthread_mutex_lock(&t->lock);
+    for (last = &t->responses; *last; last = &(*last)->next);
+    *last = canned;
+    pthread_mutex_unlock(&t->lock);
+
+    return true;
+}
+
+const fw_mem_request*
+fw_mem_requests(fw_transport *transport)
+{
+    return ((mem_transport*)transport->impl)->requests;
+}
+
+void
+fw_mem_clear(fw_transport *transport)
+{
+    mem_transport *t = transport->impl;
+
+    pthread_mutex_lock(&t->lock);
+    mem_clear(t);
+    pthread_mutex_unlock(&t->lock);
+}
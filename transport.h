@@ -0,0 +1,123 @@
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <curl/curl.h>
+
+typedef struct fw_buf {
+    char *data; // always NUL-terminated if not NULL
+    size_t size;
+    size_t cap;
+} fw_buf;
+
+// Request classes of the scheduled transport, the other ones ignore them
+typedef enum fw_priority {
+    FW_PRIO_INTERACTIVE, // someone is waiting for it
+    FW_PRIO_BACKGROUND,  // refreshes and submissions
+    FW_PRIO_BULK,        // uploads
+    FW_PRIO_COUNT,
+} fw_priority;
+
+// Cancels the requests it's given to, from any thread. A request is cancelled
+// as well when the token of a parent is.
+typedef struct fw_cancel {
+    atomic_bool cancelled;
+    long long deadline_ms; // monotonic, 0 means none
+    const struct fw_cancel *parent;
+} fw_cancel;
+
+typedef struct fw_http_request {
+    const char *method;
+    const char *target;
+    const struct curl_slist *headers;
+
+    // The body is either a buffer or a file streamed from its current position
+    const char *body;
+    size_t body_size;
+    FILE *body_file;
+
+    long timeout_ms; // 0 means no timeout
+    int priority;    // fw_priority
+    const fw_cancel *cancel; // NULL for none
+    bool fresh_connection;   // not multiplexed on a connection in use (HTTP/2)
+} fw_http_request;
+
+typedef struct fw_http_response {
+    long status;
+    fw_buf headers; // raw header lines
+    fw_buf body;
+    char error[CURL_ERROR_SIZE];
+} fw_http_response;
+
+typedef struct fw_transport {
+    void *impl;
+
+    bool (*send)(void *impl, const fw_http_request *req, fw_http_response *resp);
+    void *(*dup)(void *impl); // an instance to be used from another thread
+    void (*free)(void *impl);
+    bool (*stats)(void *impl, long *handshake_us, long *saved_us); // optional
+
+    int priority; // the least class of the requests sent through this copy
+    const fw_cancel *cancel; // of the requests sent through this copy, NULL for none
+} fw_transport;
+
+typedef struct fw_sched_opts {
+    size_t max_active; // transfers at once, 0 is the default of 6
+    size_t max_bulk;   // bulk transfers at once, 0 is the default of 1
+
+    // Bulk rate caps in bytes per second, 0 means no cap
+    curl_off_t bulk_send_rate;
+    curl_off_t bulk_recv_rate;
+
+    // Bulk rate caps while interactive requests are in flight, 0 keeps the above
+    curl_off_t yield_send_rate;
+    curl_off_t yield_recv_rate;
+
+    const char *cache_path; // see fw_curl_transport_cached, NULL for none
+
+    // HTTP/2: the transfers are weighted streams of a single connection
+    bool http2;
+    size_t max_streams; // streams at once, 0 is the default of 100
+
+    // TLS 1.3 early data on the resumed sessions (curl 8.11 and later). Only
+    // GETs send it, over connections of their own, as it can be replayed.
+    bool early_data;
+} fw_sched_opts;
+
+// Captured request of the in-memory transport
+typedef struct fw_mem_request {
+    char *method;
+    char *target;
+    fw_buf headers;
+    fw_buf body;
+    struct fw_mem_request *next;
+} fw_mem_request;
+
+void fw_cancel_init(fw_cancel *cancel, long timeout_ms, const fw_cancel *parent);
+void fw_cancel_trigger(fw_cancel *cancel);
+bool fw_cancelled(const fw_cancel *cancel);
+const char *fw_cancel_reason(const fw_cancel *cancel);
+long fw_cancel_left_ms(const fw_cancel *cancel);
+
+bool buf_append(fw_buf *buf, const void *data, size_t size);
+void buf_free(fw_buf *buf);
+
+const char *fw_response_header(const fw_http_response *resp, const char *name, char *value, size_t size);
+void fw_response_free(fw_http_response *resp);
+
+bool fw_curl_transport(fw_transport *transport, const char *scheme, const char *server);
+// TLS sessions, HSTS and Alt-Svc are loaded from and saved to ``cache_path``
+bool fw_curl_transport_cached(fw_transport *transport, const char *scheme, const char *server, const char *cache_path);
+bool fw_sched_transport(fw_transport *transport, const char *scheme, const char *server, const fw_sched_opts *opts);
+
+// TLS handshake of the warm-up and the time the cached session saved on it
+bool fw_transport_stats(const fw_transport *transport, long *handshake_us, long *saved_us);
+
+bool fw_mem_transport(fw_transport *transport);
+bool fw_mem_respond(fw_transport *transport, const char *method, const char *target, long status, const char *body);
+const fw_mem_request *fw_mem_requests(fw_transport *transport);
+void fw_mem_clear(fw_transport *transport);
+
+#endif // _TRANSPORT_H
@@ -12,12 +12,18 @@ url_enc_init()
         rfc3986[i] = isalnum(i) || i == '~' || i == '-' || i == '.' || i == '_' ? i : 0;
 }
 
+// NULL if the encoded ``s`` doesn't fit in ``size`` bytes
 char*
-url_encode(const char *s, char *enc)
+url_encode_n(const char *s, char *enc, size_t size)
 {
-    char *ret = enc;
+    char *ret = enc, *end = enc + size;
 
-    for (; *s; ++s){
+    if (!size)
+        return NULL;
+
+    for (*enc = '\0'; *s; ++s) {
+        if (end - enc <= (rfc3986[*(unsigned char*)s] ? 1 : 3))
+            return NULL;
         if (rfc3986[*(unsigned char*)s])
             sprintf(enc, "%c", rfc3986[*(unsigned char*)s]);
         else
@@ -1,7 +1,9 @@
 #ifndef _URLENCODE_H
 #define _URLENCODE_H
 
+#include <stddef.h>
+
 void url_enc_init();
-char *url_encode(const char *s, char *enc);
+char *url_encode_n(const char *s, char *enc, size_t size);
 
 #endif // _URLENCODE_H